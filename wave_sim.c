@@ -14,8 +14,22 @@
 // STANDARD DEFINITONS
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <complex.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
 
 //******************************************************************************
 //  Defines
@@ -60,30 +74,819 @@
 #define xs1 50
 #define ys1 50
 
+// Image renderers
+#define RENDER_PALETTE_SIZE 16   // Colours the field is quantized to
+#define RENDER_RANGE        0.6  // Field value at the ends of the palette
+#define RENDER_SCALE        4    // Default pixels per node
+#define RENDER_KITTY_CHUNK  4096 // Base64 bytes per kitty escape
+#define RENDER_CELL_WIDTH   8    // Terminal cell size in pixels when the
+#define RENDER_CELL_HEIGHT  16   // terminal does not report it
+
+// Kernel tuning, SIMD_WIDTH follows the native vector register size
+#if defined(__AVX__)
+#define SIMD_WIDTH 4             // Doubles per vector in the SIMD kernels
+#else
+#define SIMD_WIDTH 2             // Doubles per vector in the SIMD kernels
+#endif
+#define BLOCK_ROWS 4             // Output rows per pass in the blocked kernel
+
+// Pipelined time stepping
+#define PIPELINE_BAND_ROWS 8     // Rows per band, at least 2
+#define PIPELINE_MAX_THREADS 64  // Upper limit for --pipeline=N
+
+// Task graph runtime
+#define TASK_TILE         32     // Nodes per side of a tile task, at most
+#define TASK_RING_LEVELS  4      // Time levels in the ring, at least 3
+#define TASK_MAX_THREADS  64     // Upper limit for --tasks=N
+
+// Parareal
+#define PARAREAL_COARSEN   2     // Coarse grid spacing and time step factor
+#define PARAREAL_TOLERANCE 1e-8  // Relative slice state change to stop at
+#define PARAREAL_MAX_SLICES 64   // Upper limit for --parareal=N
+
+// Memory accounting
+#define MEM_HEADER_SIZE 64       // Bytes before each tracked block, keeps the
+                                 // block cache line aligned
+#define FIELD_LINE_DOUBLES 8     // Doubles per cache line, the unit of row padding
+
+// Binary frame stream
+#define STREAM_MAGIC       "WVF1" // Frame header magic
+#define STREAM_HEADER_SIZE 40     // Bytes in a frame header
+#define STREAM_QUEUE_DEPTH 4      // Frames queued for the writer thread
+#define STREAM_MAX_LEVELS  8      // Upper limit for --stream-pyramid=L
+
+// Accuracy-driven grid planner
+#define PLAN_PHASE_ERROR 0.1     // Default phase error budget in radians
+#define PLAN_DIRECTIONS  90      // Propagation angles sampled in 0..pi/2
+
+// Bloch-periodic unit cell
+#define BLOCH_CELL_NODES 32      // Nodes per side of the unit cell
+#define BLOCH_COURANT    0.9     // Time step as a fraction of the CFL limit
+#define BLOCH_PERIODS    300     // Simulated time in units of a / c
+#define BLOCH_PROBES     4       // Field probes per k-point
+#define BLOCH_MAX_FREQ   1.2     // Highest normalized frequency f a / c searched
+#define BLOCH_FREQ_BINS  600     // Spectrum samples up to BLOCH_MAX_FREQ
+#define BLOCH_BANDS      8       // Most bands reported per k-point
+#define BLOCH_PEAK_FLOOR 1e-3    // Fraction of the strongest peak kept as a band
+#define BLOCH_ROD_INDEX  3.0     // Refractive index of the optional rod
+#define BLOCH_MAX_POINTS 256     // Upper limit for --bloch-points=N
+
+// Source and receiver surveys
+#define SURVEY_SOURCE_SPACING 8  // Node spacing of the default source list
+#define SURVEY_ENCODE_RUNS    8  // Default encoded runs
+#define SURVEY_MAX_DELAY      100 // Longest random source delay in steps
+#define SURVEY_ENCODE_SEED    2024u // Seed of the source codes
+
+// Live metrics export
+#define METRICS_INTERVAL 1.0     // Default seconds between snapshots
+
+// Tiled field storage
+#define FIELD_TILE 16            // Nodes per side of a tile of --layout=tiled
+
+// Incremental checkpoints
+#define CHECKPOINT_MAGIC      "WVC1" // Chain file header magic
+#define CHECKPOINT_TILE       16 // Nodes per side of a checkpoint tile
+#define CHECKPOINT_EVERY      10 // Default steps between checkpoints
+#define CHECKPOINT_FULL_EVERY 8  // Default checkpoints per full image
+
+// Subregion re-simulation
+#define REPLAY_MAGIC   "WVR1"    // Contour recording header magic
+#define REPLAY_PADDING 16        // Default scattered field nodes around the region
+
+// Preview run
+#define PREVIEW_COARSEN      4   // Preview grid spacing and time step factor
+#define PREVIEW_REPORT_EVERY 10  // Preview steps between diagnostics lines
+
+// Benchmark settings
+#define BENCH_CELL_UPDATES 2.0e8 // Target cell updates per timed measurement
+#define BENCH_MIN_STEPS    3     // Minimum time steps per measurement
+
+// Performance cliff scan
+#define CLIFF_FROM         480   // Default first grid size
+#define CLIFF_TO           1088  // Default last grid size
+#define CLIFF_STEP         4     // Default grid size increment
+#define CLIFF_CELL_UPDATES 2.0e7 // Cell updates per timed measurement
+#define CLIFF_REPEATS      3     // Measurements per size, the best is kept
+#define CLIFF_WINDOW       4     // Sizes on each side a size is compared with
+#define CLIFF_DROP         0.85  // Flag sizes slower than this share of their neighbours
+#define CLIFF_BAR          30    // Characters of the throughput bar
+
+//******************************************************************************
+//  Types
+//******************************************************************************
+
+// Subsystems that memory is accounted to
+typedef enum
+{
+    MEM_FIELDS,                  // Time level arrays
+    MEM_HALOS,                   // Boundary and halo strips
+    MEM_PROBES,                  // Probe and receiver traces
+    MEM_RENDER,                  // Render and display buffers
+    MEM_IO,                      // Output queues and frame buffers
+    MEM_RUNTIME,                 // Threading and scheduling bookkeeping
+    MEM_TAG_COUNT
+} MemTag;
+
+// Live and peak bytes of one tag
+typedef struct
+{
+    atomic_long live;
+    atomic_long peak;
+    atomic_long blocks;          // Allocations made
+} MemCounter;
+
+// Vector of doubles via the GCC/Clang vector extension
+typedef double vec_t __attribute__((vector_size(SIMD_WIDTH * sizeof(double))));
+
+// Interior update kernel: computes Un_p1 from Un0 and Un_m1 for all interior
+// nodes of a rows x cols grid, with ox2 = Ox * Ox and oy2 = Oy * Oy
+typedef void (*InteriorKernel)(double** Un_p1, double** Un0, double** Un_m1,
+                               int rows, int cols, double ox2, double oy2);
+
+// One time level inside a field layout. Node (ii, jj) lives at
+// rows[ii][jj * stride + offset]: stride 1 for separate arrays, stride 2 with
+// the time level's slot as offset for the interleaved layout
+typedef struct
+{
+    double** rows;
+    int      stride;
+    int      offset;
+} FieldRef;
+
+#define FIELD(f, ii, jj) ((f).rows[ii][(jj) * (f).stride + (f).offset])
+
+// Grid and scheme constants of one simulation. The defaults come from the
+// mesh and physics defines; coarser or smaller grids derive their own.
+typedef struct
+{
+    int    rows;                 // Nodes in x-direction
+    int    cols;                 // Nodes in y-direction
+    double timeStep;             // Time step
+    double ox2;                  // Ox * Ox
+    double oy2;                  // Oy * Oy
+    double coefX;                // Radiating boundary coefficient in x
+    double coefY;                // Radiating boundary coefficient in y
+    int    srcRow;               // Source node
+    int    srcCol;
+} WaveGrid;
+
+// Contiguous scratch strips for the boundary stage. Strided edges are
+// gathered into these so the radiating boundary update runs on unit stride
+typedef struct
+{
+    int     length;              // Capacity of each strip in nodes (twice
+                                 // the longest edge, for paired edges)
+    double* nowEdge;             // Un0 on the edge
+    double* nowInner;            // Un0 one node inside the edge
+    double* nextInner;           // Un_p1 one node inside the edge
+    double* nextEdge;            // Un_p1 on the edge (result)
+} EdgeScratch;
+
+// Field storage layouts
+typedef enum
+{
+    LAYOUT_SEPARATE,             // Un_p1, Un0 and Un_m1 in three arrays
+    LAYOUT_INTERLEAVED,          // Un0 and Un_m1 interleaved in one array
+    LAYOUT_TILED,                // Tiles allocated on the first non-zero write
+} FieldLayout;
+
+// Tiles of all time levels of a tiled run
+typedef struct
+{
+    int live;                    // Tiles with storage of their own
+    int peak;
+    int total;                   // Tiles, zero or not
+} TileCount;
+
+// Time level stored as FIELD_TILE square tiles. Tiles that have only held
+// zeros share one read-only zero tile.
+typedef struct
+{
+    int        rows;
+    int        cols;
+    int        tileRows;         // Tiles in x-direction
+    int        tileCols;         // Tiles in y-direction
+    double**   tiles;            // Row major, FIELD_TILE * FIELD_TILE each
+    TileCount* count;
+} TiledField;
+
+// Per-thread progress counter for the pipelined mode, padded to its own
+// cache line. Holds step * bandCount + bands finished in that step.
+typedef struct
+{
+    _Alignas(64) atomic_long done;
+} BandProgress;
+
+// What the stream does when the consumer falls behind
+typedef enum
+{
+    STREAM_BLOCK,                // Wait for the consumer
+    STREAM_DROP,                 // Discard the new frame
+    STREAM_COALESCE,             // Replace the newest queued frame
+} StreamPolicy;
+
+// Framed binary snapshots written to a file descriptor by a writer thread.
+// Buffers cycle between the free stack, the queue and the writer.
+typedef struct
+{
+    int             fd;
+    StreamPolicy    policy;
+    int             every;       // Stream every this many steps
+    int             stride;      // Keep every this many nodes in x and y
+    int             rows;        // Streamed frame size after decimation
+    int             cols;
+    size_t          frameBytes;  // Header plus payload
+    int             levels;      // Pyramid levels after each frame
+    int             levelFds[STREAM_MAX_LEVELS];
+    int             levelRows[STREAM_MAX_LEVELS + 1]; // Level 0 is the frame
+    int             levelCols[STREAM_MAX_LEVELS + 1];
+    size_t          levelStart[STREAM_MAX_LEVELS + 2]; // Byte offset of each
+                                 // level in a buffer, then the buffer size
+    unsigned char*  buffers[STREAM_QUEUE_DEPTH + 1];
+    int             freeList[STREAM_QUEUE_DEPTH + 1];
+    int             freeCount;
+    int             queue[STREAM_QUEUE_DEPTH];
+    int             head;
+    int             count;
+    int             closing;
+    int             broken;      // Consumer went away
+    long            written;
+    long            dropped;
+    long            coalesced;
+    pthread_mutex_t lock;
+    pthread_cond_t  changed;
+    pthread_t       writer;
+} FrameStream;
+
+// How frames are drawn in the terminal
+typedef enum
+{
+    RENDER_NONE,                 // Not at all
+    RENDER_TEXT,                 // Coloured characters, one node per "* "
+    RENDER_SIXEL,                // Sixel image
+    RENDER_KITTY,                // Kitty graphics protocol image
+} RenderMode;
+
+// Terminal image renderer. Frames are quantized to a palette, encoded into
+// one buffer and written with a single call.
+typedef struct
+{
+    RenderMode     mode;
+    int            scale;        // Pixels per node
+    int            width;        // Image size in pixels
+    int            height;
+    int            cellCols;     // Kitty: terminal cells the image covers
+    int            cellRows;
+    unsigned char* pixels;       // Palette index per pixel
+    unsigned char* rgb;          // Kitty: pixels as RGB
+    unsigned char* packed;       // Kitty: compressed RGB, with USE_ZLIB
+    size_t         packedCapacity;
+    char*          out;          // Escape sequences of one frame
+    size_t         outCapacity;
+    long           frames;
+    double         bytes;        // Written so far
+    double         textBytes;    // The text renderer's bytes for the same frames
+} FrameRenderer;
+
+// Where finished frames go
+typedef struct
+{
+    FrameRenderer* renderer;     // Terminal display, or NULL
+    FrameStream*   stream;       // Binary frame stream, or NULL
+} FrameSink;
+
+// Live metrics of a run, written by a background thread. The solver only
+// stores the step count, and an energy value when the writer asks for one.
+typedef struct
+{
+    const char*     path;        // Writes PATH.prom and PATH.json
+    double          interval;    // Seconds between snapshots
+    int             totalSteps;
+    long            cellsPerStep;
+    double          timeStep;
+    double          start;       // wallTime at the start of the run
+    FrameStream*    stream;      // Queue depth source, or NULL
+    atomic_int      step;        // Steps finished
+    atomic_int      energyWanted;
+    atomic_int      energyStep;  // Step the energy value belongs to
+    _Atomic double  energy;
+    int             stopping;
+    int             failed;      // A write failed, reported once
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    pthread_t       writer;
+} MetricsExport;
+
+// Checkpoint chain: full images of both time levels, each followed by
+// records of only the tiles that changed since the checkpoint before
+typedef struct
+{
+    FILE*     file;
+    int       rows;
+    int       cols;
+    int       tileCount;
+    int       every;             // Steps between checkpoints
+    int       fullEvery;         // Checkpoints per full image
+    double*   savedNow;          // Time levels as of the last checkpoint,
+    double*   savedPrev;         // row major, to find the changed tiles
+    uint32_t* dirty;             // Changed tiles of the current checkpoint
+    int       taken;
+    int       fullCount;
+    long      tilesWritten;
+    double    bytes;
+    double    fullBytes;         // Bytes had every checkpoint been full
+} CheckpointChain;
+
+// One timed phase of a time step
+typedef struct
+{
+    const char* name;            // Phase name, shared with the Python profiler
+    int         step;
+    double      start;           // Seconds since the trace origin
+    double      duration;        // Seconds
+} TraceEvent;
+
+// Per-phase timings of a run, written as Chrome trace event JSON
+typedef struct
+{
+    TraceEvent* events;
+    int         count;
+    int         capacity;
+    double      origin;          // wallTime at the start of the run
+} PhaseTrace;
+
+// Pipelined temporal parallelism: thread k computes steps k, k + T, ...
+// band by band, each band trailing the previous step's thread
+typedef struct
+{
+    WaveGrid       grid;
+    double***      levels;       // Ring of ringSize time level buffers
+    int            ringSize;     // threadCount + 2
+    int            steps;
+    int            bandRows;
+    int            bandCount;
+    int            threadCount;
+    InteriorKernel kernel;
+    BandProgress*  progress;     // One per thread
+    atomic_long    consumed;     // Frames taken by the consumer
+    FrameSink*     sink;         // Frame consumer, or NULL for none
+} Pipeline;
+
+// Worker thread argument
+typedef struct
+{
+    Pipeline* pipeline;
+    int       index;
+} PipelineWorker;
+
+// Ready tasks of one worker. The owner pushes and pops at the bottom,
+// other workers steal from the top.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int*            items;       // Ring of task ids
+    int             capacity;
+    int             top;         // Oldest task
+    int             bottom;      // One past the newest task
+} TaskDeque;
+
+// Time steps as a dependency graph of tile tasks, plus a snapshot (frame
+// outputs) and a probe (metrics) task per step, run by a work-stealing pool.
+// A tile of step n + 1 can start as soon as its own and its side
+// neighbours' tiles of step n are done.
+typedef struct
+{
+    WaveGrid       grid;
+    int            steps;
+    double***      levels;       // Ring of TASK_RING_LEVELS time levels
+    int            tileRows;
+    int            tileCols;
+    int            tileCount;
+    int*           rowStart;     // First row of each tile row, then rows
+    int*           colStart;     // First column of each tile column, then cols
+    int            perStep;      // Task ids per step: tiles, snapshot, probe
+    int            taskCount;    // Tasks that run
+    atomic_int*    pending;      // Unfinished dependencies of each task, a ring
+                                 // of TASK_RING_LEVELS steps
+    atomic_int     finished;
+    int            threadCount;
+    TaskDeque*     deques;       // One per worker
+    InteriorKernel kernel;
+    FrameSink*     sink;         // Frame outputs, or NULL for no snapshots
+    MetricsExport* metrics;      // Live metrics, or NULL for no probes
+} TaskGraph;
+
+// Task graph worker thread argument
+typedef struct
+{
+    TaskGraph* graph;
+    int        index;
+    long       run;              // Tasks run
+    long       stolen;           // Tasks taken from other workers
+} TaskWorker;
+
+// Leapfrog state at the start or end of a time slice: time levels n, n-1
+typedef struct
+{
+    double** Un0;
+    double** Un_m1;
+} SliceState;
+
+// Fine propagation of one Parareal time slice, run on its own thread
+typedef struct
+{
+    const WaveGrid* grid;
+    InteriorKernel  kernel;
+    int             firstStep;   // Fine step index at the slice start
+    int             stepCount;   // Fine steps in the slice
+    SliceState*     in;
+    SliceState*     out;
+    double          cpuTime;     // Thread CPU time spent, in seconds
+} SliceJob;
+
+// Square unit cell of a periodic medium with period a = l, whose fields
+// wrap around with a Bloch phase. Nodes are row-major, nodes * nodes.
+typedef struct
+{
+    int     nodes;               // Nodes per side
+    double  spacing;             // Grid size in x and y
+    double  timeStep;
+    int     steps;               // Time steps per k-point
+    double  courant2;            // (c dt / spacing)^2
+    double* speed2;              // (local speed / c)^2 per node
+} BlochCell;
+
+// One wavevector of a band structure sweep and the bands found there
+typedef struct
+{
+    double kx;                   // Bloch wavevector in units of 2 pi / a
+    double ky;
+    int    bandCount;
+    double bands[BLOCH_BANDS];   // Normalized frequencies f a / c, ascending
+} BlochPoint;
+
+// k-points shared by the sweep threads
+typedef struct
+{
+    const BlochCell* cell;
+    BlochPoint*      points;
+    int              count;
+    atomic_int       next;       // Next k-point to take
+} BlochBatch;
+
+// A node of the grid, for source and receiver lists
+typedef struct
+{
+    int row;
+    int col;
+} GridNode;
+
+// Field on both sides of a region's contour, recorded every step so that the
+// region alone can be simulated again
+typedef struct
+{
+    FILE*     file;
+    int       linkCount;         // Node pairs across the contour
+    GridNode* inner;             // Node of each pair inside the region
+    GridNode* outer;             // Node of each pair outside the region
+    int*      axis;              // 0 for pairs in x, 1 for pairs in y
+    double*   values;            // Inner and outer value of each pair
+} RegionRecord;
+
+// Which way the runs of a survey go
+typedef enum
+{
+    SURVEY_AUTO,                 // Fire whichever list is shorter
+    SURVEY_DIRECT,               // Fire each source, record the receivers
+    SURVEY_RECIPROCAL,           // Fire each receiver, record the sources
+    SURVEY_CHECK,                // Both, and compare
+} SurveyMode;
+
+// Codes that let every source fire in the same run
+typedef enum
+{
+    ENCODE_NONE,                 // One run per fired node
+    ENCODE_POLARITY,             // Random sign per source and run
+    ENCODE_DELAY,                // Random sign and firing delay per source and run
+} SurveyEncoding;
+
+// Traces of every source at every receiver
+typedef struct
+{
+    GridNode* sources;
+    int       sourceCount;
+    GridNode* receivers;
+    int       receiverCount;
+    int       steps;
+    double*   traces;            // [source][receiver][step]
+} Survey;
+
+// Shots shared by the survey threads
+typedef struct
+{
+    const Survey*   survey;
+    const WaveGrid* grid;
+    InteriorKernel  kernel;
+    int             reciprocal;  // Shots fire the receivers
+    double*         traces;      // [source][receiver][step] output
+    atomic_int      next;        // Next shot to take
+} SurveyBatch;
+
+// Encoded runs shared by the survey threads
+typedef struct
+{
+    const Survey*   survey;
+    const WaveGrid* grid;
+    InteriorKernel  kernel;
+    const double*   weights;     // [run][source] polarity
+    const int*      delays;      // [run][source] delay in steps
+    int             runs;
+    int             steps;       // Recorded steps per run
+    double*         records;     // [run][receiver][step] blended traces
+    atomic_int      next;        // Next run to take
+} EncodedBatch;
+
+// Named kernel for command line selection and benchmarking
+typedef struct
+{
+    const char*    name;
+    InteriorKernel kernel;
+} KernelEntry;
+
+// Coarse shadow run of the whole job, for an early look at a long run
+typedef struct
+{
+    WaveGrid       grid;         // Coarse grid constants
+    int            factor;       // Coarsening of the full run's grid
+    InteriorKernel kernel;
+    int            steps;        // Coarse steps covering the full run
+    FrameStream    stream;
+    pthread_t      thread;
+    int            reached;      // Steps taken, fewer if cancelled
+    double         elapsed;      // Wall time of the preview
+    struct sigaction oldInt;     // SIGINT and SIGTERM actions before the preview
+    struct sigaction oldTerm;
+} PreviewRun;
+
+// Pull-based time marching for consumers that own the loop
+typedef struct
+{
+    WaveGrid       grid;
+    InteriorKernel kernel;
+    double**       levels[3];    // Time levels n+1, n and n-1 after a step
+    EdgeScratch    scratch;
+    int            steps;        // Steps after which the frames end
+    int            step;         // Steps taken
+} FrameIterator;
+
+// Command line options
+typedef struct
+{
+    int            benchmark;    // Run the kernel benchmark instead of the sim
+    int            rows;         // Grid nodes in x, Nx unless --grid is given
+    int            cols;         // Grid nodes in y, Ny unless --grid is given
+    int            plan;         // Print a grid plan instead of the sim
+    double         planDistance; // Propagation distance, 0 is the run's
+    double         planBudget;   // Phase error budget in radians
+    int            bloch;        // Run a Bloch band structure sweep
+    int            blochPoints;  // k-points per segment of the sweep path
+    double         blochRod;     // Rod radius as a fraction of the period
+    int            survey;       // Run a source and receiver survey
+    SurveyMode     surveyMode;   // Direct or reciprocal runs
+    const char*    sourcePath;   // Survey source list, or NULL for a default
+    const char*    receiverPath; // Survey receiver list, or NULL for a default
+    const char*    surveyPath;   // Survey trace output, or NULL
+    SurveyEncoding encoding;     // Fire all sources at once with codes
+    int            encodeRuns;   // Encoded runs
+    InteriorKernel kernel;       // Interior update kernel for the sim
+    FieldLayout    layout;       // Time level storage layout
+    int            pipeline;     // Pipelined time stepping threads, 0 is off
+    int            parareal;     // Parareal time slices, 0 is off
+    int            tasks;        // Task graph runtime threads, 0 is off
+    const char*    streamPath;   // Binary frame stream, "-" is stdout
+    int            streamEvery;  // Stream every this many steps
+    int            streamStride; // Spatial decimation of streamed frames
+    int            streamLevels; // Max-abs pyramid levels of streamed frames
+    StreamPolicy   streamPolicy; // Slow consumer policy
+    const char*    tracePath;    // Per-phase timing trace output, or NULL
+    const char*    metricsPath;  // Live metrics base path, or NULL
+    double         metricsEvery; // Seconds between metrics snapshots
+    RenderMode     render;       // Terminal display of frames
+    int            renderScale;  // Pixels per node of the image renderers
+    const char*    checkpointPath; // Checkpoint chain output, or NULL
+    int            checkpointEvery; // Steps between checkpoints
+    int            checkpointFull; // Checkpoints per full image
+    const char*    restorePath;  // Checkpoint chain to resume from, or NULL
+    const char*    recordPath;   // Region contour recording, or NULL
+    int            region[4];    // Recorded region, first and after last row and column
+    int            replay;       // Re-simulate a recorded region
+    int            obstacle[3];  // Replay: obstacle row, column and radius, 0 is none
+    int            replayPadding; // Replay: scattered field nodes around the region
+    const char*    previewPath;  // Coarse preview frame stream, or NULL
+    int            cliffs;       // Scan grid sizes for performance cliffs
+    int            cliffFrom;    // First grid size of the scan
+    int            cliffTo;      // Last grid size of the scan
+    int            cliffStep;    // Grid size increment of the scan
+} SimOptions;
+
+//******************************************************************************
+//  Globals
+//******************************************************************************
+
+// Per-tag memory counters, the last entry is the total over all tags
+static MemCounter memCounters[MEM_TAG_COUNT + 1];
+
+static const char* const memTagNames[MEM_TAG_COUNT + 1] =
+{
+    "fields", "halos", "probes", "render", "io", "runtime", "total"
+};
+
+// Set by Ctrl-C while a preview runs, the full run stops after its step
+static atomic_int cancelRequested;
+
 //******************************************************************************
 //  Functions
 //******************************************************************************
 
 /**
  *******************************************************************************
- * @brief:     Dynamic allocation of a 2D array
- * @parameter: rows: Number of rows
+ * @brief:     Add a signed amount to a memory counter and raise its peak
+ * @parameter: counter: Counter to update
+ * @parameter: bytes: Bytes allocated (positive) or freed (negative)
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void memCount(MemCounter* counter, long bytes)
+{
+    long now = atomic_fetch_add(&counter->live, bytes) + bytes;
+    long peak = atomic_load(&counter->peak);
+    while (now > peak && !atomic_compare_exchange_weak(&counter->peak, &peak, now))
+    {
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Allocate memory accounted to a subsystem. Blocks are 64-byte
+ *             aligned and must be released with memFree.
+ * @parameter: bytes: Number of bytes
+ * @parameter: tag: Subsystem to account the block to
+ * @return:    Pointer to the block, exits on failure
+ *******************************************************************************
+ */
+void* memAlloc(size_t bytes, MemTag tag)
+{
+    size_t total = (MEM_HEADER_SIZE + bytes + MEM_HEADER_SIZE - 1)
+                   / MEM_HEADER_SIZE * MEM_HEADER_SIZE;
+    char* block = (char*) aligned_alloc(MEM_HEADER_SIZE, total);
+    if (block == NULL)
+    {
+        fprintf(stderr, "out of memory allocating %zu bytes for %s\n",
+                bytes, memTagNames[tag]);
+        exit(1);
+    }
+
+    size_t* header = (size_t*) block;
+    header[0] = bytes;
+    header[1] = (size_t) tag;
+    memCount(&memCounters[tag], (long) bytes);
+    memCount(&memCounters[MEM_TAG_COUNT], (long) bytes);
+    atomic_fetch_add(&memCounters[tag].blocks, 1);
+
+    return block + MEM_HEADER_SIZE;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free a block from memAlloc
+ * @parameter: p: Block pointer, may be NULL
+ * @return:    N/A
+ *******************************************************************************
+ */
+void memFree(void* p)
+{
+    if (p == NULL)
+    {
+        return;
+    }
+
+    char* block = (char*) p - MEM_HEADER_SIZE;
+    size_t* header = (size_t*) block;
+    memCount(&memCounters[header[1]], -(long) header[0]);
+    memCount(&memCounters[MEM_TAG_COUNT], -(long) header[0]);
+    free(block);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Reset every peak to the current live usage, so the next peak
+ *             reading covers only what runs after this call
+ * @parameter: N/A
+ * @return:    N/A
+ *******************************************************************************
+ */
+void memResetPeaks(void)
+{
+    for (int t = 0; t <= MEM_TAG_COUNT; t++)
+    {
+        atomic_store(&memCounters[t].peak, atomic_load(&memCounters[t].live));
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Peak bytes of a tag, MEM_TAG_COUNT gives the total
+ * @parameter: tag: Tag index
+ * @return:    Peak bytes since start or the last memResetPeaks
+ *******************************************************************************
+ */
+long memPeak(int tag)
+{
+    return atomic_load(&memCounters[tag].peak);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Print live and peak usage per subsystem
+ * @parameter: out: Stream to print to
+ * @return:    N/A
+ *******************************************************************************
+ */
+void printMemoryReport(FILE* out)
+{
+    fprintf(out, "%-8s %12s %12s %10s\n", "memory", "live KiB", "peak KiB", "blocks");
+    for (int t = 0; t <= MEM_TAG_COUNT; t++)
+    {
+        long blocks = 0;
+        if (t < MEM_TAG_COUNT)
+        {
+            blocks = atomic_load(&memCounters[t].blocks);
+        }
+        else
+        {
+            for (int k = 0; k < MEM_TAG_COUNT; k++)
+            {
+                blocks += atomic_load(&memCounters[k].blocks);
+            }
+        }
+        fprintf(out, "%-8s %12.1f %12.1f %10ld\n", memTagNames[t],
+                atomic_load(&memCounters[t].live) / 1024.0,
+                atomic_load(&memCounters[t].peak) / 1024.0, blocks);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Row stride that allocate2DArray uses for rows of cols doubles:
+ *             whole cache lines, and an odd number of them. Rows a power of
+ *             two bytes apart map the stencil's rows onto the same cache sets
+ *             and alias in the store buffer, while an odd line count spreads
+ *             them over every set at every cache level. Costs at most two
+ *             lines per row.
  * @parameter: cols: Number of cols
- * @return:    2D array pointer
+ * @return:    Doubles from one row to the next
  *******************************************************************************
  */
-double** allocate2DArray(int rows, int cols)
+int rowStride(int cols)
+{
+    int lines = (cols + FIELD_LINE_DOUBLES - 1) / FIELD_LINE_DOUBLES;
+    return (lines | 1) * FIELD_LINE_DOUBLES;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     2D array as one block with rows a given number of doubles apart
+ * @parameter: rows: Number of rows
+ * @parameter: stride: Doubles from one row to the next
+ * @return:    2D array pointer, freed with free2DArray
+ *******************************************************************************
+ */
+double** allocateStrided(int rows, int stride)
 {
-    double** array = (double**) malloc(rows * sizeof(double*));
+    double** array = (double**) memAlloc(rows * sizeof(double*), MEM_FIELDS);
+    double* block = (double*) memAlloc((size_t) rows * stride * sizeof(double), MEM_FIELDS);
 
     for (int i = 0; i < rows; i++)
     {
-        array[i] = (double*) malloc(cols * sizeof(double));
+        array[i] = block + (size_t) i * stride;
     }
 
     return array;
 }
 
+/**
+ *******************************************************************************
+ * @brief:     Dynamic allocation of a 2D array, rows padded to rowStride
+ * @parameter: rows: Number of rows
+ * @parameter: cols: Number of cols
+ * @return:    2D array pointer
+ *******************************************************************************
+ */
+double** allocate2DArray(int rows, int cols)
+{
+    return allocateStrided(rows, rowStride(cols));
+}
+
 /**
  *******************************************************************************
  * @brief:     Free the memory of a 2D array
@@ -94,12 +897,9 @@ double** allocate2DArray(int rows, int cols)
  */
 void free2DArray(double** array, int rows)
 {
-    for (int i = 0; i < rows; i++)
-    {
-        free(array[i]);
-    }
-
-    free(array);
+    (void) rows;
+    memFree(array[0]);
+    memFree(array);
 }
 
 /**
@@ -122,6 +922,20 @@ void initializeArray(double** array, int rows, int cols)
     }
 }
 
+/**
+ *******************************************************************************
+ * @brief:     Monotonic wall clock in seconds
+ * @parameter: N/A
+ * @return:    Time in seconds
+ *******************************************************************************
+ */
+double wallTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 /**
  *******************************************************************************
  * @brief:     Obtain the color value of a node
@@ -163,13 +977,13 @@ void getColor(double value, char* color)
 /**
  *******************************************************************************
  * @brief:     Print the 2D node plane via a terminal
- * @parameter: array: Pointer to the 2D array with the associated node values
+ * @parameter: field: Time level with the associated node values
  * @parameter: rows: The number of rows in the array
  * @parameter: cols: The number of cols in the array
  * @return:    N/A
  *******************************************************************************
  */
-void printWave(double** array, int rows, int cols)
+void printWave(FieldRef field, int rows, int cols)
 {
     printf(CURSOR);
 
@@ -177,7 +991,7 @@ void printWave(double** array, int rows, int cols)
     {
         for (int j = 0; j < cols; j++)
         {
-            double value = array[i][j];
+            double value = FIELD(field, i, j);
             char color[COLOR_BUFFER_SIZE];
             getColor(value, color);
             printf("%s* " RESET, color);
@@ -191,94 +1005,6772 @@ void printWave(double** array, int rows, int cols)
 
 /**
  *******************************************************************************
- * @brief:     Main function of the file
- * @parameter: N/A
+ * @brief:     Colour of a palette entry: a diverging map from blue through
+ *             black to red and yellow over [-RENDER_RANGE, RENDER_RANGE]
+ * @parameter: index: Palette entry
+ * @parameter: rgb: Set to the red, green and blue values, 0 to 255
  * @return:    N/A
  *******************************************************************************
  */
-int main(void)
+static void paletteColor(int index, unsigned char rgb[3])
 {
-    // Allocate memory for 2D arrays
-    double** Un_p1 = allocate2DArray(Nx, Ny);
-    double** Un0 = allocate2DArray(Nx, Ny);
-    double** Un_m1 = allocate2DArray(Nx, Ny);
+    double t = (index + 0.5) / RENDER_PALETTE_SIZE * 2.0 - 1.0;
+    double a = fabs(t);
+    rgb[0] = (unsigned char)(255.0 * (t > 0.0 ? a : 0.0));
+    rgb[1] = (unsigned char)(255.0 * 0.6 * a * a);
+    rgb[2] = (unsigned char)(255.0 * (t < 0.0 ? a : 0.0));
+}
 
-    initializeArray(Un_p1, Nx, Ny);
-    initializeArray(Un0, Nx, Ny);
-    initializeArray(Un_m1, Nx, Ny);
+/**
+ *******************************************************************************
+ * @brief:     Set up an image renderer for frames of a grid
+ * @parameter: renderer: Renderer to fill
+ * @parameter: mode: Text, sixel or kitty
+ * @parameter: scale: Pixels per node in x and y
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @return:    N/A
+ *******************************************************************************
+ */
+void initRenderer(FrameRenderer* renderer, RenderMode mode, int scale, int rows, int cols)
+{
+    memset(renderer, 0, sizeof(*renderer));
+    renderer->mode = mode;
+    renderer->scale = scale;
+    renderer->width = cols * scale;
+    renderer->height = rows * scale;
+    if (mode == RENDER_TEXT)
+    {
+        return;
+    }
 
-    // Time marchings starts here
-    for (int n = 0; n < n_stop; n++)
+    // Kitty images are sent with one pixel per node and scaled by the
+    // terminal to the cells they would cover at the requested scale
+    if (mode == RENDER_KITTY)
     {
-        // Compute the general wave equation solution
-        for (int jj = 1; jj < Ny - 1; jj++)
+        struct winsize size;
+        int cellWidth = RENDER_CELL_WIDTH;
+        int cellHeight = RENDER_CELL_HEIGHT;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 0
+            && size.ws_xpixel > 0 && size.ws_ypixel > 0)
         {
-            for (int ii = 1; ii < Nx - 1; ii++)
-            {
-                Un_p1[ii][jj] = 2 * Un0[ii][jj]
-                    + Ox * Ox * (Un0[ii + 1][jj] - 2 * Un0[ii][jj] + Un0[ii - 1][jj])
-                    + Oy * Oy * (Un0[ii][jj + 1] - 2 * Un0[ii][jj] + Un0[ii][jj - 1])
-                    - Un_m1[ii][jj];
-            }
+            cellWidth = size.ws_xpixel / size.ws_col;
+            cellHeight = size.ws_ypixel / size.ws_row;
         }
+        renderer->cellCols = (renderer->width + cellWidth - 1) / cellWidth;
+        renderer->cellRows = (renderer->height + cellHeight - 1) / cellHeight;
+        renderer->scale = 1;
+        renderer->width = cols;
+        renderer->height = rows;
+    }
 
-        // Source nodes
-        Un_p1[xs1][ys1] = 1 * exp(-pow((n * dt - T0) / (w / 2), 2.0))
-                            * sin(((2 * M_PI * c) / l) * (n * dt));
+    size_t pixels = (size_t)renderer->width * renderer->height;
+    renderer->pixels = (unsigned char*) memAlloc(pixels, MEM_RENDER);
 
-        // Left nodes
-        int ii = 0;
-        for (int jj = 1; jj < Ny - 1; jj++)
-        {
-            Un_p1[ii][jj] = Un0[ii + 1][jj] + (((c * dt - dx) / (c * dt + dx))
-                                            * (Un_p1[ii + 1][jj] - Un0[ii][jj]));
-        }
+    if (mode == RENDER_SIXEL)
+    {
+        // Per band of six pixel rows, each colour emits at most one sixel per
+        // column plus its selector and a carriage return
+        size_t bands = (renderer->height + 5) / 6;
+        renderer->outCapacity = 256 + RENDER_PALETTE_SIZE * 24
+                                + bands * (RENDER_PALETTE_SIZE * (renderer->width + 8) + 1);
+    }
+    else
+    {
+        renderer->rgb = (unsigned char*) memAlloc(3 * pixels, MEM_RENDER);
+        renderer->packedCapacity = 3 * pixels;
+#ifdef USE_ZLIB
+        renderer->packedCapacity = compressBound(3 * pixels);
+        renderer->packed = (unsigned char*) memAlloc(renderer->packedCapacity, MEM_RENDER);
+#endif
+        size_t encoded = 4 * ((renderer->packedCapacity + 2) / 3);
+        renderer->outCapacity = 256 + encoded + (encoded / RENDER_KITTY_CHUNK + 1) * 32;
+    }
+    renderer->out = (char*) memAlloc(renderer->outCapacity, MEM_RENDER);
+}
 
-        // Right nodes
-        ii = Nx - 1;
-        for (int jj = 1; jj < Ny - 1; jj++)
+/**
+ *******************************************************************************
+ * @brief:     Bytes the text renderer prints for a frame
+ * @parameter: field: Time level to print
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @return:    Byte count
+ *******************************************************************************
+ */
+static size_t textFrameBytes(FieldRef field, int rows, int cols)
+{
+    size_t bytes = strlen(CURSOR) + rows;
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
         {
-            Un_p1[ii][jj] = Un0[ii - 1][jj] + (((c * dt - dx) / (c * dt + dx))
-                                            * (Un_p1[ii - 1][jj] - Un0[ii][jj]));
+            char color[COLOR_BUFFER_SIZE];
+            getColor(FIELD(field, i, j), color);
+            bytes += strlen(color) + 2 + strlen(RESET);
         }
+    }
+    return bytes;
+}
 
-        // Top nodes
-        int jj = Ny - 1;
-        for (int ii = 1; ii < Nx - 1; ii++)
-        {
-            Un_p1[ii][jj] = Un0[ii][jj - 1] + (((c * dt - dy) / (c * dt + dy))
-                                            * (Un_p1[ii][jj - 1] - Un0[ii][jj]));
-        }
+/**
+ *******************************************************************************
+ * @brief:     Append a run of one sixel, repeat-introduced when shorter
+ * @parameter: out: Output position
+ * @parameter: run: Repeat count, may be 0
+ * @parameter: sixel: Sixel character
+ * @return:    Bytes written
+ *******************************************************************************
+ */
+static size_t sixelRun(char* out, int run, char sixel)
+{
+    if (run > 3)
+    {
+        return sprintf(out, "!%d%c", run, sixel);
+    }
+    memset(out, sixel, run);
+    return run;
+}
 
-        // Bottom nodes
-        jj = 0;
-        for (int ii = 1; ii < Nx - 1; ii++)
+/**
+ *******************************************************************************
+ * @brief:     Encode the quantized frame as a sixel image. Each band of six
+ *             pixel rows is drawn once per colour it uses, with runs of equal
+ *             sixels run-length encoded.
+ * @parameter: renderer: Renderer with the palette indices filled
+ * @return:    Bytes written to the output buffer
+ *******************************************************************************
+ */
+static size_t encodeSixel(FrameRenderer* renderer)
+{
+    const int width = renderer->width;
+    const int height = renderer->height;
+    char* out = renderer->out;
+    size_t n = 0;
+
+    n += sprintf(out + n, "\033Pq\"1;1;%d;%d", width, height);
+    for (int k = 0; k < RENDER_PALETTE_SIZE; k++)
+    {
+        unsigned char rgb[3];
+        paletteColor(k, rgb);
+        n += sprintf(out + n, "#%d;2;%d;%d;%d", k, rgb[0] * 100 / 255, rgb[1] * 100 / 255,
+                     rgb[2] * 100 / 255);
+    }
+
+    for (int y0 = 0; y0 < height; y0 += 6)
+    {
+        int bandRows = height - y0 < 6 ? height - y0 : 6;
+        int used[RENDER_PALETTE_SIZE] = { 0 };
+        for (int y = y0; y < y0 + bandRows; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                used[renderer->pixels[(size_t)y * width + x]] = 1;
+            }
+        }
+
+        int first = 1;
+        for (int k = 0; k < RENDER_PALETTE_SIZE; k++)
+        {
+            if (!used[k])
+            {
+                continue;
+            }
+            if (!first)
+            {
+                out[n++] = '$';
+            }
+            first = 0;
+            n += sprintf(out + n, "#%d", k);
+
+            // Runs of equal sixels, trailing empty ones are left out
+            int run = 0;
+            int previous = -1;
+            int pendingEmpty = 0;
+            for (int x = 0; x <= width; x++)
+            {
+                int bits = -1;
+                if (x < width)
+                {
+                    bits = 0;
+                    for (int b = 0; b < bandRows; b++)
+                    {
+                        bits |= (renderer->pixels[(size_t)(y0 + b) * width + x] == k) << b;
+                    }
+                }
+                if (bits == previous)
+                {
+                    run++;
+                    continue;
+                }
+                if (previous >= 0)
+                {
+                    if (previous == 0)
+                    {
+                        pendingEmpty = run;
+                    }
+                    else
+                    {
+                        n += sixelRun(out + n, pendingEmpty, '?');
+                        n += sixelRun(out + n, run, (char)(63 + previous));
+                        pendingEmpty = 0;
+                    }
+                }
+                previous = bits;
+                run = 1;
+            }
+        }
+        out[n++] = '-';
+    }
+
+    n += sprintf(out + n, "\033\\");
+    return n;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Base64 encode a buffer
+ * @parameter: in: Bytes to encode
+ * @parameter: size: Byte count
+ * @parameter: out: Output, 4 * ((size + 2) / 3) characters
+ * @return:    Characters written
+ *******************************************************************************
+ */
+static size_t encodeBase64(const unsigned char* in, size_t size, char* out)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t n = 0;
+
+    for (size_t k = 0; k < size; k += 3)
+    {
+        unsigned int v = in[k] << 16;
+        v |= (k + 1 < size) ? in[k + 1] << 8 : 0;
+        v |= (k + 2 < size) ? in[k + 2] : 0;
+        out[n++] = digits[(v >> 18) & 63];
+        out[n++] = digits[(v >> 12) & 63];
+        out[n++] = (k + 1 < size) ? digits[(v >> 6) & 63] : '=';
+        out[n++] = (k + 2 < size) ? digits[v & 63] : '=';
+    }
+    return n;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Encode the quantized frame as a kitty graphics protocol image,
+ *             zlib compressed when built with USE_ZLIB. The image keeps one
+ *             id, so each frame replaces the previous one, and is scaled to
+ *             its cells by the terminal.
+ * @parameter: renderer: Renderer with the palette indices filled
+ * @return:    Bytes written to the output buffer
+ *******************************************************************************
+ */
+static size_t encodeKitty(FrameRenderer* renderer)
+{
+    size_t pixels = (size_t)renderer->width * renderer->height;
+    unsigned char palette[RENDER_PALETTE_SIZE][3];
+    for (int k = 0; k < RENDER_PALETTE_SIZE; k++)
+    {
+        paletteColor(k, palette[k]);
+    }
+    for (size_t p = 0; p < pixels; p++)
+    {
+        memcpy(renderer->rgb + 3 * p, palette[renderer->pixels[p]], 3);
+    }
+
+    const unsigned char* payload = renderer->rgb;
+    size_t payloadSize = 3 * pixels;
+    const char* compression = "";
+#ifdef USE_ZLIB
+    uLongf packedSize = renderer->packedCapacity;
+    if (compress2(renderer->packed, &packedSize, renderer->rgb, 3 * pixels, Z_BEST_SPEED) == Z_OK)
+    {
+        payload = renderer->packed;
+        payloadSize = packedSize;
+        compression = ",o=z";
+    }
+#endif
+
+    // Base64 at the end of the buffer, then copied out in chunks
+    size_t encodedSize = 4 * ((payloadSize + 2) / 3);
+    char* encoded = renderer->out + renderer->outCapacity - encodedSize;
+    encodeBase64(payload, payloadSize, encoded);
+
+    char* out = renderer->out;
+    size_t n = 0;
+    for (size_t k = 0; k < encodedSize; k += RENDER_KITTY_CHUNK)
+    {
+        size_t chunk = encodedSize - k < RENDER_KITTY_CHUNK ? encodedSize - k : RENDER_KITTY_CHUNK;
+        int more = (k + chunk < encodedSize);
+        if (k == 0)
+        {
+            n += sprintf(out + n, "\033_Ga=T,f=24,s=%d,v=%d,c=%d,r=%d,i=1,q=2,C=1%s,m=%d;",
+                         renderer->width, renderer->height, renderer->cellCols,
+                         renderer->cellRows, compression, more);
+        }
+        else
+        {
+            n += sprintf(out + n, "\033_Gm=%d;", more);
+        }
+        memmove(out + n, encoded + k, chunk);
+        n += chunk;
+        n += sprintf(out + n, "\033\\");
+    }
+    return n;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Draw a frame in the terminal with the renderer's protocol
+ * @parameter: renderer: Renderer
+ * @parameter: field: Time level to draw
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @return:    N/A
+ *******************************************************************************
+ */
+void renderFrame(FrameRenderer* renderer, FieldRef field, int rows, int cols)
+{
+    if (renderer->mode == RENDER_TEXT)
+    {
+        printWave(field, rows, cols);
+        return;
+    }
+
+    // Quantize each node to the palette and scale it up to pixels
+    const int scale = renderer->scale;
+    for (int i = 0; i < rows; i++)
+    {
+        unsigned char* line = renderer->pixels + (size_t)i * scale * renderer->width;
+        for (int j = 0; j < cols; j++)
+        {
+            double norm = (FIELD(field, i, j) + RENDER_RANGE) / (2.0 * RENDER_RANGE);
+            int k = (int)(norm * RENDER_PALETTE_SIZE);
+            k = k < 0 ? 0 : (k >= RENDER_PALETTE_SIZE ? RENDER_PALETTE_SIZE - 1 : k);
+            memset(line + j * scale, k, scale);
+        }
+        for (int s = 1; s < scale; s++)
+        {
+            memcpy(line + (size_t)s * renderer->width, line, renderer->width);
+        }
+    }
+
+    size_t bytes = (renderer->mode == RENDER_SIXEL) ? encodeSixel(renderer)
+                                                    : encodeKitty(renderer);
+    printf(CURSOR);
+    fwrite(renderer->out, 1, bytes, stdout);
+    fflush(stdout);
+
+    renderer->frames++;
+    renderer->bytes += bytes + strlen(CURSOR);
+    renderer->textBytes += textFrameBytes(field, rows, cols);
+
+    // ~ 30 fps
+    usleep(33000);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Report the bytes per frame and free a renderer
+ * @parameter: renderer: Renderer to free
+ * @return:    N/A
+ *******************************************************************************
+ */
+void freeRenderer(FrameRenderer* renderer)
+{
+    if (renderer->frames > 0)
+    {
+        fprintf(stderr, "render: %s %dx%d px, %ld frames, %.1f KiB per frame, "
+                "%.1f KiB with the text renderer\n",
+                renderer->mode == RENDER_SIXEL ? "sixel" : "kitty", renderer->width,
+                renderer->height, renderer->frames, renderer->bytes / renderer->frames / 1024.0,
+                renderer->textBytes / renderer->frames / 1024.0);
+    }
+    memFree(renderer->pixels);
+    memFree(renderer->rgb);
+    memFree(renderer->packed);
+    memFree(renderer->out);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Load a vector from a possibly unaligned address
+ * @parameter: p: Pointer to the first element
+ * @return:    Loaded vector
+ *******************************************************************************
+ */
+static inline vec_t loadVec(const double* p)
+{
+    vec_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Store a vector to a possibly unaligned address
+ * @parameter: p: Pointer to the first element
+ * @parameter: v: Vector to store
+ * @return:    N/A
+ *******************************************************************************
+ */
+static inline void storeVec(double* p, vec_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Interior update, scalar reference version. Walks the grid in the
+ *             original jj-outer order.
+ * @parameter: Un_p1: Time level n+1 (output)
+ * @parameter: Un0: Time level n
+ * @parameter: Un_m1: Time level n-1
+ * @parameter: rows: Number of rows (x nodes)
+ * @parameter: cols: Number of cols (y nodes)
+ * @parameter: ox2: Squared Courant number in x
+ * @parameter: oy2: Squared Courant number in y
+ * @return:    N/A
+ *******************************************************************************
+ */
+void updateInteriorScalar(double** Un_p1, double** Un0, double** Un_m1,
+                          int rows, int cols, double ox2, double oy2)
+{
+    for (int jj = 1; jj < cols - 1; jj++)
+    {
+        for (int ii = 1; ii < rows - 1; ii++)
+        {
+            Un_p1[ii][jj] = 2 * Un0[ii][jj]
+                + ox2 * (Un0[ii + 1][jj] - 2 * Un0[ii][jj] + Un0[ii - 1][jj])
+                + oy2 * (Un0[ii][jj + 1] - 2 * Un0[ii][jj] + Un0[ii][jj - 1])
+                - Un_m1[ii][jj];
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Scalar interior update of a single row segment [j0, j1)
+ * @parameter: Un_p1, Un0, Un_m1: Time levels n+1, n, n-1
+ * @parameter: ii: Row index
+ * @parameter: j0: First column
+ * @parameter: j1: One past the last column
+ * @parameter: ox2, oy2: Squared Courant numbers
+ * @return:    N/A
+ *******************************************************************************
+ */
+static inline void updateRowTail(double** Un_p1, double** Un0, double** Un_m1,
+                                 int ii, int j0, int j1, double ox2, double oy2)
+{
+    for (int jj = j0; jj < j1; jj++)
+    {
+        Un_p1[ii][jj] = 2 * Un0[ii][jj]
+            + ox2 * (Un0[ii + 1][jj] - 2 * Un0[ii][jj] + Un0[ii - 1][jj])
+            + oy2 * (Un0[ii][jj + 1] - 2 * Un0[ii][jj] + Un0[ii][jj - 1])
+            - Un_m1[ii][jj];
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Interior update, SIMD version. Walks each row contiguously and
+ *             computes SIMD_WIDTH nodes per iteration.
+ * @parameter: See updateInteriorScalar
+ * @return:    N/A
+ *******************************************************************************
+ */
+void updateInteriorSimd(double** Un_p1, double** Un0, double** Un_m1,
+                        int rows, int cols, double ox2, double oy2)
+{
+    for (int ii = 1; ii < rows - 1; ii++)
+    {
+        const double* up = Un0[ii - 1];
+        const double* mid = Un0[ii];
+        const double* down = Un0[ii + 1];
+        const double* old = Un_m1[ii];
+        double* out = Un_p1[ii];
+
+        int jj = 1;
+        for (; jj + SIMD_WIDTH < cols; jj += SIMD_WIDTH)
+        {
+            vec_t center = loadVec(mid + jj);
+            storeVec(out + jj, 2 * center
+                + ox2 * (loadVec(down + jj) - 2 * center + loadVec(up + jj))
+                + oy2 * (loadVec(mid + jj + 1) - 2 * center + loadVec(mid + jj - 1))
+                - loadVec(old + jj));
+        }
+        updateRowTail(Un_p1, Un0, Un_m1, ii, jj, cols - 1, ox2, oy2);
+    }
+}
+
+// Lane shuffles across two vectors a, b of width W:
+//   SHIFT_IN_LEFT(a, b)  = {a[W-1], b[0], ..., b[W-2]}
+//   SHIFT_IN_RIGHT(a, b) = {a[1], ..., a[W-1], b[0]}
+//   EVEN_LANES(a, b)     = even lanes of the 2W-lane concatenation a:b
+//   ODD_LANES(a, b)      = odd lanes of a:b
+//   ZIP_LO(a, b)         = {a[0], b[0], a[1], b[1], ...} first W lanes
+//   ZIP_HI(a, b)         = the remaining W lanes of the zip
+#if defined(__clang__)
+#define LANE_SHUFFLE(a, b, ...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+typedef long long lane_mask_t __attribute__((vector_size(SIMD_WIDTH * sizeof(long long))));
+#define LANE_SHUFFLE(a, b, ...) __builtin_shuffle(a, b, (lane_mask_t){ __VA_ARGS__ })
+#endif
+
+#if SIMD_WIDTH == 4
+#define SHIFT_IN_LEFT(a, b)  LANE_SHUFFLE(a, b, 3, 4, 5, 6)
+#define SHIFT_IN_RIGHT(a, b) LANE_SHUFFLE(a, b, 1, 2, 3, 4)
+#define EVEN_LANES(a, b)     LANE_SHUFFLE(a, b, 0, 2, 4, 6)
+#define ODD_LANES(a, b)      LANE_SHUFFLE(a, b, 1, 3, 5, 7)
+#define ZIP_LO(a, b)         LANE_SHUFFLE(a, b, 0, 4, 1, 5)
+#define ZIP_HI(a, b)         LANE_SHUFFLE(a, b, 2, 6, 3, 7)
+#else
+#define SHIFT_IN_LEFT(a, b)  LANE_SHUFFLE(a, b, 1, 2)
+#define SHIFT_IN_RIGHT(a, b) LANE_SHUFFLE(a, b, 1, 2)
+#define EVEN_LANES(a, b)     LANE_SHUFFLE(a, b, 0, 2)
+#define ODD_LANES(a, b)      LANE_SHUFFLE(a, b, 1, 3)
+#define ZIP_LO(a, b)         LANE_SHUFFLE(a, b, 0, 2)
+#define ZIP_HI(a, b)         LANE_SHUFFLE(a, b, 1, 3)
+#endif
+
+// Fully unroll the per-row loops so the sliding window stays in registers
+#if defined(__clang__)
+#define UNROLL_ROWS _Pragma("unroll")
+#else
+#define UNROLL_ROWS _Pragma("GCC unroll 8")
+#endif
+
+/**
+ *******************************************************************************
+ * @brief:     Interior update, register-blocked (unroll-and-jam) version.
+ *             Computes BLOCK_ROWS output rows per pass. Each Un0 vector is
+ *             loaded once and reused from registers as the up/down neighbour
+ *             of the adjacent rows and, via lane shifts, as the left/right
+ *             neighbour of the adjacent vectors.
+ * @parameter: See updateInteriorScalar
+ * @return:    N/A
+ *******************************************************************************
+ */
+void updateInteriorBlocked(double** Un_p1, double** Un0, double** Un_m1,
+                           int rows, int cols, double ox2, double oy2)
+{
+    int ii = 1;
+    for (; ii + BLOCK_ROWS <= rows - 1; ii += BLOCK_ROWS)
+    {
+        // Input rows ii-1 .. ii+BLOCK_ROWS, output rows ii .. ii+BLOCK_ROWS-1
+        const double* in[BLOCK_ROWS + 2];
+        const double* old[BLOCK_ROWS];
+        double* out[BLOCK_ROWS];
+        for (int r = 0; r < BLOCK_ROWS + 2; r++)
+        {
+            in[r] = Un0[ii - 1 + r];
+        }
+        for (int r = 0; r < BLOCK_ROWS; r++)
+        {
+            old[r] = Un_m1[ii + r];
+            out[r] = Un_p1[ii + r];
+        }
+
+        // Sliding window of vectors along jj for each output row
+        vec_t prev[BLOCK_ROWS];
+        vec_t cur[BLOCK_ROWS + 2];
+        int jj = 1;
+        if (jj + SIMD_WIDTH < cols)
+        {
+            for (int r = 0; r < BLOCK_ROWS; r++)
+            {
+                prev[r] = (vec_t){0};
+                prev[r][SIMD_WIDTH - 1] = in[r + 1][0];
+                cur[r + 1] = loadVec(in[r + 1] + jj);
+            }
+        }
+
+        for (; jj + SIMD_WIDTH < cols; jj += SIMD_WIDTH)
+        {
+            int fullNext = jj + 2 * SIMD_WIDTH <= cols;
+            cur[0] = loadVec(in[0] + jj);
+            cur[BLOCK_ROWS + 1] = loadVec(in[BLOCK_ROWS + 1] + jj);
+
+            vec_t next[BLOCK_ROWS];
+            UNROLL_ROWS
+            for (int r = 0; r < BLOCK_ROWS; r++)
+            {
+                if (fullNext)
+                {
+                    next[r] = loadVec(in[r + 1] + jj + SIMD_WIDTH);
+                }
+                else
+                {
+                    next[r] = (vec_t){0};
+                    next[r][0] = in[r + 1][jj + SIMD_WIDTH];
+                }
+            }
+
+            UNROLL_ROWS
+            for (int r = 0; r < BLOCK_ROWS; r++)
+            {
+                vec_t center = cur[r + 1];
+                storeVec(out[r] + jj, 2 * center
+                    + ox2 * (cur[r + 2] - 2 * center + cur[r])
+                    + oy2 * (SHIFT_IN_RIGHT(center, next[r]) - 2 * center
+                             + SHIFT_IN_LEFT(prev[r], center))
+                    - loadVec(old[r] + jj));
+            }
+
+            // Slide the window only after every row used the current vectors
+            UNROLL_ROWS
+            for (int r = 0; r < BLOCK_ROWS; r++)
+            {
+                prev[r] = cur[r + 1];
+                cur[r + 1] = next[r];
+            }
+        }
+
+        for (int r = 0; r < BLOCK_ROWS; r++)
+        {
+            updateRowTail(Un_p1, Un0, Un_m1, ii + r, jj, cols - 1, ox2, oy2);
+        }
+    }
+
+    // Leftover rows that do not fill a block
+    for (; ii < rows - 1; ii++)
+    {
+        updateRowTail(Un_p1, Un0, Un_m1, ii, 1, cols - 1, ox2, oy2);
+    }
+}
+
+// Available interior kernels, the first one is the default
+static const KernelEntry kernelTable[] =
+{
+    { "scalar",  updateInteriorScalar  },
+    { "simd",    updateInteriorSimd    },
+    { "blocked", updateInteriorBlocked },
+};
+#define KERNEL_COUNT ((int)(sizeof(kernelTable) / sizeof(kernelTable[0])))
+
+/**
+ *******************************************************************************
+ * @brief:     Look up an interior kernel by name
+ * @parameter: name: Kernel name
+ * @return:    Kernel function, or NULL if unknown
+ *******************************************************************************
+ */
+InteriorKernel findKernel(const char* name)
+{
+    for (int k = 0; k < KERNEL_COUNT; k++)
+    {
+        if (strcmp(kernelTable[k].name, name) == 0)
+        {
+            return kernelTable[k].kernel;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Interior update of one row in the interleaved layout. Node jj of
+ *             a row holds time level n at [2 * jj + cur] and time level n-1
+ *             at [2 * jj + (1 - cur)]; time level n+1 overwrites n-1 in place.
+ * @parameter: up, mid, down: Rows ii-1, ii and ii+1
+ * @parameter: cols: Number of cols (y nodes)
+ * @parameter: cur: Slot holding time level n (0 or 1)
+ * @parameter: ox2, oy2: Squared Courant numbers
+ * @return:    N/A
+ *******************************************************************************
+ */
+static inline __attribute__((always_inline))
+void updateRowInterleaved(const double* up, double* mid, const double* down,
+                          int cols, int cur, double ox2, double oy2)
+{
+    const int old = 1 - cur;
+
+    // Load SIMD_WIDTH interleaved nodes as two vectors and split the slots
+#define SLOT_VEC(p, slot) ((slot) ? ODD_LANES(loadVec(p), loadVec((p) + SIMD_WIDTH)) \
+                                  : EVEN_LANES(loadVec(p), loadVec((p) + SIMD_WIDTH)))
+
+    // The left/right neighbours come from a sliding window of time level n
+    // vectors; reloading them would overlap the chunk just stored and stall
+    // store-to-load forwarding
+    int jj = 1;
+    vec_t prev = (vec_t){0};
+    vec_t center = (vec_t){0};
+    if (jj + SIMD_WIDTH < cols)
+    {
+        prev[SIMD_WIDTH - 1] = mid[cur];
+        center = SLOT_VEC(mid + 2 * jj, cur);
+    }
+
+    for (; jj + SIMD_WIDTH < cols; jj += SIMD_WIDTH)
+    {
+        double* p = mid + 2 * jj;
+        vec_t next;
+        if (jj + 2 * SIMD_WIDTH <= cols)
+        {
+            next = SLOT_VEC(p + 2 * SIMD_WIDTH, cur);
+        }
+        else
+        {
+            next = (vec_t){0};
+            next[0] = p[2 * SIMD_WIDTH + cur];
+        }
+
+        vec_t result = 2 * center
+            + ox2 * (SLOT_VEC(down + 2 * jj, cur) - 2 * center + SLOT_VEC(up + 2 * jj, cur))
+            + oy2 * (SHIFT_IN_RIGHT(center, next) - 2 * center + SHIFT_IN_LEFT(prev, center))
+            - SLOT_VEC(p, old);
+
+        // Re-interleave, keeping time level n and replacing n-1 with n+1
+        vec_t slot0 = cur ? result : center;
+        vec_t slot1 = cur ? center : result;
+        storeVec(p, ZIP_LO(slot0, slot1));
+        storeVec(p + SIMD_WIDTH, ZIP_HI(slot0, slot1));
+
+        prev = center;
+        center = next;
+    }
+
+#undef SLOT_VEC
+
+    for (; jj < cols - 1; jj++)
+    {
+        double center = mid[2 * jj + cur];
+        mid[2 * jj + old] = 2 * center
+            + ox2 * (down[2 * jj + cur] - 2 * center + up[2 * jj + cur])
+            + oy2 * (mid[2 * jj + 2 + cur] - 2 * center + mid[2 * jj - 2 + cur])
+            - mid[2 * jj + old];
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Interior update for the interleaved layout. Reads and writes a
+ *             single array, so each row costs one stream instead of three.
+ * @parameter: U: Interleaved array of rows x (2 * cols) doubles
+ * @parameter: rows: Number of rows (x nodes)
+ * @parameter: cols: Number of cols (y nodes)
+ * @parameter: cur: Slot holding time level n; n+1 is written to the other one
+ * @parameter: ox2, oy2: Squared Courant numbers
+ * @return:    N/A
+ *******************************************************************************
+ */
+void updateInteriorInterleaved(double** U, int rows, int cols, int cur,
+                               double ox2, double oy2)
+{
+    for (int ii = 1; ii < rows - 1; ii++)
+    {
+        // Constant slot arguments let the compiler specialize the row loop
+        if (cur == 0)
+        {
+            updateRowInterleaved(U[ii - 1], U[ii], U[ii + 1], cols, 0, ox2, oy2);
+        }
+        else
+        {
+            updateRowInterleaved(U[ii - 1], U[ii], U[ii + 1], cols, 1, ox2, oy2);
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Grid with the default physics on a rows x cols mesh
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @return:    Grid constants
+ *******************************************************************************
+ */
+WaveGrid makeGrid(int rows, int cols)
+{
+    WaveGrid grid;
+    grid.rows = rows;
+    grid.cols = cols;
+    grid.timeStep = dt;
+    grid.ox2 = Ox * Ox;
+    grid.oy2 = Oy * Oy;
+    grid.coefX = ((c * dt - dx) / (c * dt + dx));
+    grid.coefY = ((c * dt - dy) / (c * dt + dy));
+    grid.srcRow = xs1;
+    grid.srcCol = ys1;
+    return grid;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Value of the pulsed point source at a time
+ * @parameter: t: Time
+ * @return:    Source value
+ *******************************************************************************
+ */
+double sourceValue(double t)
+{
+    return 1 * exp(-pow((t - T0) / (w / 2), 2.0)) * sin(((2 * M_PI * c) / l) * t);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Inject the point source into time level n+1
+ * @parameter: next: Time level n+1
+ * @parameter: grid: Grid constants
+ * @parameter: n: Time step index
+ * @return:    N/A
+ *******************************************************************************
+ */
+void applySource(FieldRef next, const WaveGrid* grid, int n)
+{
+    FIELD(next, grid->srcRow, grid->srcCol) = sourceValue(n * grid->timeStep);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Allocate the boundary scratch strips
+ * @parameter: scratch: Scratch to fill
+ * @parameter: edge: Longest edge in nodes
+ * @return:    N/A
+ *******************************************************************************
+ */
+void allocateEdgeScratch(EdgeScratch* scratch, int edge)
+{
+    int length = 2 * edge;
+    scratch->length = length;
+    scratch->nowEdge = (double*) memAlloc(length * sizeof(double), MEM_HALOS);
+    scratch->nowInner = (double*) memAlloc(length * sizeof(double), MEM_HALOS);
+    scratch->nextInner = (double*) memAlloc(length * sizeof(double), MEM_HALOS);
+    scratch->nextEdge = (double*) memAlloc(length * sizeof(double), MEM_HALOS);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free the boundary scratch strips
+ * @parameter: scratch: Scratch to free
+ * @return:    N/A
+ *******************************************************************************
+ */
+void freeEdgeScratch(EdgeScratch* scratch)
+{
+    memFree(scratch->nowEdge);
+    memFree(scratch->nowInner);
+    memFree(scratch->nextInner);
+    memFree(scratch->nextEdge);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Radiating boundary update on contiguous strips:
+ *             nextEdge = nowInner + coef * (nextInner - nowEdge)
+ * @parameter: nextEdge: Output strip
+ * @parameter: nowInner, nextInner, nowEdge: Input strips
+ * @parameter: count: Number of nodes
+ * @parameter: coef: (c dt - h) / (c dt + h) for the edge normal spacing h
+ * @return:    N/A
+ *******************************************************************************
+ */
+void murStrip(double* nextEdge, const double* nowInner, const double* nextInner,
+              const double* nowEdge, int count, double coef)
+{
+    int k = 0;
+    for (; k + SIMD_WIDTH <= count; k += SIMD_WIDTH)
+    {
+        storeVec(nextEdge + k, loadVec(nowInner + k)
+                 + (coef * (loadVec(nextInner + k) - loadVec(nowEdge + k))));
+    }
+    for (; k < count; k++)
+    {
+        nextEdge[k] = nowInner[k] + (coef * (nextInner[k] - nowEdge[k]));
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Copy part of a row into a contiguous strip
+ * @parameter: field: Source time level
+ * @parameter: ii: Row index
+ * @parameter: j0: First column
+ * @parameter: count: Number of nodes
+ * @parameter: strip: Destination strip
+ * @return:    N/A
+ *******************************************************************************
+ */
+void gatherRow(FieldRef field, int ii, int j0, int count, double* strip)
+{
+    for (int k = 0; k < count; k++)
+    {
+        strip[k] = FIELD(field, ii, j0 + k);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Copy a contiguous strip back into part of a row
+ * @parameter: field: Destination time level
+ * @parameter: ii: Row index
+ * @parameter: j0: First column
+ * @parameter: count: Number of nodes
+ * @parameter: strip: Source strip
+ * @return:    N/A
+ *******************************************************************************
+ */
+void scatterRow(FieldRef field, int ii, int j0, int count, const double* strip)
+{
+    for (int k = 0; k < count; k++)
+    {
+        FIELD(field, ii, j0 + k) = strip[k];
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Radiating boundary update of a left or right edge (ii fixed,
+ *             jj varying). With stride 1 the edge is already contiguous and is
+ *             updated in place, otherwise it goes through the scratch strips.
+ * @parameter: Un_p1: Time level n+1, interior already updated
+ * @parameter: Un0: Time level n
+ * @parameter: ii: Edge row
+ * @parameter: inner: Row one node inside the edge
+ * @parameter: cols: Number of cols (y nodes)
+ * @parameter: coef: Radiating boundary coefficient in x
+ * @parameter: scratch: Boundary scratch strips
+ * @return:    N/A
+ *******************************************************************************
+ */
+void updateRowEdge(FieldRef Un_p1, FieldRef Un0, int ii, int inner, int cols,
+                   double coef, EdgeScratch* scratch)
+{
+    int count = cols - 2;
+    if (Un_p1.stride == 1 && Un0.stride == 1)
+    {
+        murStrip(&FIELD(Un_p1, ii, 1), &FIELD(Un0, inner, 1),
+                 &FIELD(Un_p1, inner, 1), &FIELD(Un0, ii, 1), count, coef);
+        return;
+    }
+
+    gatherRow(Un0, ii, 1, count, scratch->nowEdge);
+    gatherRow(Un0, inner, 1, count, scratch->nowInner);
+    gatherRow(Un_p1, inner, 1, count, scratch->nextInner);
+    murStrip(scratch->nextEdge, scratch->nowInner, scratch->nextInner,
+             scratch->nowEdge, count, coef);
+    scatterRow(Un_p1, ii, 1, count, scratch->nextEdge);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Radiating boundary update of the bottom and top edges (jj = 0
+ *             and jj = cols - 1, ii varying). These are strided in every
+ *             layout, so both are gathered in one pass over the rows into
+ *             back-to-back strips, updated together and scattered back.
+ * @parameter: Un_p1: Time level n+1, interior already updated
+ * @parameter: Un0: Time level n
+ * @parameter: first: First edge row, at least 1
+ * @parameter: last: One past the last edge row, at most rows - 1
+ * @parameter: cols: Number of cols (y nodes)
+ * @parameter: coef: Radiating boundary coefficient in y
+ * @parameter: scratch: Boundary scratch strips
+ * @return:    N/A
+ *******************************************************************************
+ */
+void updateColumnEdges(FieldRef Un_p1, FieldRef Un0, int first, int last,
+                       int cols, double coef, EdgeScratch* scratch)
+{
+    int count = last - first;
+    double* nowEdge = scratch->nowEdge;
+    double* nowInner = scratch->nowInner;
+    double* nextInner = scratch->nextInner;
+
+    // Bottom edge in [0, count), top edge in [count, 2 * count)
+    for (int k = 0; k < count; k++)
+    {
+        int ii = first + k;
+        nowEdge[k] = FIELD(Un0, ii, 0);
+        nowInner[k] = FIELD(Un0, ii, 1);
+        nextInner[k] = FIELD(Un_p1, ii, 1);
+        nowEdge[count + k] = FIELD(Un0, ii, cols - 1);
+        nowInner[count + k] = FIELD(Un0, ii, cols - 2);
+        nextInner[count + k] = FIELD(Un_p1, ii, cols - 2);
+    }
+
+    murStrip(scratch->nextEdge, nowInner, nextInner, nowEdge, 2 * count, coef);
+
+    for (int k = 0; k < count; k++)
+    {
+        int ii = first + k;
+        FIELD(Un_p1, ii, 0) = scratch->nextEdge[k];
+        FIELD(Un_p1, ii, cols - 1) = scratch->nextEdge[count + k];
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Apply the radiating boundary conditions and corner averages to
+ *             the rows [r0, r1). Bands must be processed in increasing order
+ *             and the band holding row 0 must also hold row 1, since edges
+ *             and corners read the Un_p1 row next to them.
+ * @parameter: Un_p1: Time level n+1, interior of these rows already updated
+ * @parameter: Un0: Time level n
+ * @parameter: grid: Grid constants
+ * @parameter: r0: First row of the band
+ * @parameter: r1: One past the last row of the band
+ * @parameter: scratch: Boundary scratch for an edge of max(rows, cols)
+ * @return:    N/A
+ *******************************************************************************
+ */
+void applyBoundaryRows(FieldRef Un_p1, FieldRef Un0, const WaveGrid* grid,
+                       int r0, int r1, EdgeScratch* scratch)
+{
+    const int rows = grid->rows;
+    const int cols = grid->cols;
+    const double coefX = grid->coefX;
+    const double coefY = grid->coefY;
+
+    // Left and right nodes run along a row
+    if (r0 == 0)
+    {
+        updateRowEdge(Un_p1, Un0, 0, 1, cols, coefX, scratch);
+    }
+    if (r1 == rows)
+    {
+        updateRowEdge(Un_p1, Un0, rows - 1, rows - 2, cols, coefX, scratch);
+    }
+
+    // Top and bottom nodes run down a column
+    int first = r0 < 1 ? 1 : r0;
+    int last = r1 > rows - 1 ? rows - 1 : r1;
+    if (last > first)
+    {
+        updateColumnEdges(Un_p1, Un0, first, last, cols, coefY, scratch);
+    }
+
+    // Simply average the corner values
+    if (r0 == 0)
+    {
+        FIELD(Un_p1, 0, 0) = 0.5 * (FIELD(Un_p1, 1, 0) + FIELD(Un_p1, 0, 1));
+    }
+    if (r1 == rows)
+    {
+        FIELD(Un_p1, rows - 1, 0) = 0.5 * (FIELD(Un_p1, rows - 2, 0) + FIELD(Un_p1, rows - 1, 1));
+        FIELD(Un_p1, rows - 1, cols - 1) = 0.5 * (FIELD(Un_p1, rows - 2, cols - 1)
+                                                  + FIELD(Un_p1, rows - 1, cols - 2));
+    }
+    if (r0 == 0)
+    {
+        FIELD(Un_p1, 0, cols - 1) = 0.5 * (FIELD(Un_p1, 0, cols - 2) + FIELD(Un_p1, 1, cols - 1));
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Apply the radiating boundary conditions and corner averages
+ * @parameter: Un_p1: Time level n+1, interior already updated
+ * @parameter: Un0: Time level n
+ * @parameter: grid: Grid constants
+ * @parameter: scratch: Boundary scratch for an edge of max(rows, cols)
+ * @return:    N/A
+ *******************************************************************************
+ */
+void applyBoundaries(FieldRef Un_p1, FieldRef Un0, const WaveGrid* grid,
+                     EdgeScratch* scratch)
+{
+    applyBoundaryRows(Un_p1, Un0, grid, 0, grid->rows, scratch);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Advance the rows [r0, r1) of a separate-array field by one time
+ *             step: interior, source and boundaries
+ * @parameter: grid: Grid constants
+ * @parameter: Un_p1, Un0, Un_m1: Time levels n+1, n, n-1
+ * @parameter: r0: First row of the band
+ * @parameter: r1: One past the last row of the band
+ * @parameter: n: Time step index
+ * @parameter: kernel: Interior update kernel
+ * @parameter: scratch: Boundary scratch for an edge of max(rows, cols)
+ * @return:    N/A
+ *******************************************************************************
+ */
+void stepBand(const WaveGrid* grid, double** Un_p1, double** Un0, double** Un_m1,
+              int r0, int r1, int n, InteriorKernel kernel, EdgeScratch* scratch)
+{
+    const int rows = grid->rows;
+    FieldRef next = { Un_p1, 1, 0 };
+    FieldRef now = { Un0, 1, 0 };
+
+    // The kernels update the interior of the array they are given, so pass
+    // the band with one halo row on each side
+    int first = r0 < 1 ? 1 : r0;
+    int last = r1 > rows - 1 ? rows - 1 : r1;
+    if (last > first)
+    {
+        kernel(Un_p1 + first - 1, Un0 + first - 1, Un_m1 + first - 1,
+               last - first + 2, grid->cols, grid->ox2, grid->oy2);
+    }
+
+    if (grid->srcRow >= r0 && grid->srcRow < r1)
+    {
+        applySource(next, grid, n);
+    }
+
+    applyBoundaryRows(next, now, grid, r0, r1, scratch);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Write a whole buffer to a file descriptor
+ * @parameter: fd: File descriptor
+ * @parameter: data: Bytes to write
+ * @parameter: size: Number of bytes
+ * @return:    0 on success, -1 on error (e.g. the reader closed the pipe)
+ *******************************************************************************
+ */
+static int writeAll(int fd, const unsigned char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t done = write(fd, data, size);
+        if (done < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += done;
+        size -= (size_t) done;
+    }
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Stream writer thread: writes queued frames in order until the
+ *             stream is closed and drained or the consumer goes away
+ * @parameter: arg: FrameStream
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* streamWriter(void* arg)
+{
+    FrameStream* stream = (FrameStream*) arg;
+
+    pthread_mutex_lock(&stream->lock);
+    for (;;)
+    {
+        while (stream->count == 0 && !stream->closing)
+        {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        if (stream->count == 0)
+        {
+            break;
+        }
+
+        int index = stream->queue[stream->head];
+        stream->head = (stream->head + 1) % STREAM_QUEUE_DEPTH;
+        stream->count--;
+        pthread_mutex_unlock(&stream->lock);
+
+        const unsigned char* buffer = stream->buffers[index];
+        int failed = writeAll(stream->fd, buffer, stream->frameBytes);
+        for (int k = 1; k <= stream->levels && !failed; k++)
+        {
+            failed = writeAll(stream->levelFds[k - 1], buffer + stream->levelStart[k],
+                              stream->levelStart[k + 1] - stream->levelStart[k]);
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        stream->freeList[stream->freeCount++] = index;
+        if (failed)
+        {
+            stream->broken = 1;
+            pthread_cond_broadcast(&stream->changed);
+            break;
+        }
+        stream->written++;
+        pthread_cond_broadcast(&stream->changed);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    return NULL;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Open a binary frame stream and start its writer thread. A FIFO
+ *             path blocks here until a reader opens the other end.
+ * @parameter: stream: Stream to fill
+ * @parameter: path: Output path, "-" for stdout
+ * @parameter: grid: Grid constants
+ * @parameter: every: Stream every this many steps
+ * @parameter: stride: Keep every this many nodes in x and y
+ * @parameter: levels: Max-abs pyramid levels, written to PATH.1 .. PATH.L
+ * @parameter: policy: Slow consumer policy
+ * @return:    0 on success, -1 if a path cannot be opened
+ *******************************************************************************
+ */
+int openFrameStream(FrameStream* stream, const char* path, const WaveGrid* grid,
+                    int every, int stride, int levels, StreamPolicy policy)
+{
+    if (strcmp(path, "-") == 0)
+    {
+        stream->fd = STDOUT_FILENO;
+    }
+    else
+    {
+        stream->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (stream->fd < 0)
+        {
+            perror(path);
+            return -1;
+        }
+    }
+
+    // A reader that exits should end the stream, not the solver
+    signal(SIGPIPE, SIG_IGN);
+
+    stream->policy = policy;
+    stream->every = every;
+    stream->stride = stride;
+    stream->rows = (grid->rows + stride - 1) / stride;
+    stream->cols = (grid->cols + stride - 1) / stride;
+    stream->frameBytes = STREAM_HEADER_SIZE
+                         + (size_t) stream->rows * stream->cols * sizeof(double);
+
+    // Each level halves the one before, rounding up, down to a single node
+    stream->levels = 0;
+    stream->levelRows[0] = stream->rows;
+    stream->levelCols[0] = stream->cols;
+    stream->levelStart[0] = 0;
+    stream->levelStart[1] = stream->frameBytes;
+    for (int k = 1; k <= levels && (stream->levelRows[k - 1] > 1 || stream->levelCols[k - 1] > 1);
+         k++)
+    {
+        char levelPath[4096];
+        snprintf(levelPath, sizeof(levelPath), "%s.%d", path, k);
+        stream->levelFds[k - 1] = open(levelPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (stream->levelFds[k - 1] < 0)
+        {
+            perror(levelPath);
+            for (int q = 0; q < stream->levels; q++)
+            {
+                close(stream->levelFds[q]);
+            }
+            if (stream->fd != STDOUT_FILENO)
+            {
+                close(stream->fd);
+            }
+            return -1;
+        }
+        stream->levels = k;
+        stream->levelRows[k] = (stream->levelRows[k - 1] + 1) / 2;
+        stream->levelCols[k] = (stream->levelCols[k - 1] + 1) / 2;
+        stream->levelStart[k + 1] = stream->levelStart[k] + STREAM_HEADER_SIZE
+                                    + (size_t) stream->levelRows[k] * stream->levelCols[k]
+                                      * sizeof(double);
+    }
+
+    stream->freeCount = 0;
+    for (int b = 0; b < STREAM_QUEUE_DEPTH + 1; b++)
+    {
+        stream->buffers[b] = (unsigned char*) memAlloc(stream->levelStart[stream->levels + 1],
+                                                       MEM_IO);
+        stream->freeList[stream->freeCount++] = b;
+    }
+    stream->head = 0;
+    stream->count = 0;
+    stream->closing = 0;
+    stream->broken = 0;
+    stream->written = 0;
+    stream->dropped = 0;
+    stream->coalesced = 0;
+
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->changed, NULL);
+    pthread_create(&stream->writer, NULL, streamWriter, stream);
+
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Write a frame header
+ * @parameter: buffer: Start of the frame
+ * @parameter: step: Time level index
+ * @parameter: rows: Rows of the payload
+ * @parameter: cols: Columns of the payload
+ * @parameter: stride: Grid nodes between payload nodes
+ * @parameter: time: Simulated time of the level
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void packHeader(unsigned char* buffer, uint32_t step, int rows, int cols, int stride,
+                       double time)
+{
+    uint32_t words[5] = { STREAM_HEADER_SIZE, step, (uint32_t) rows, (uint32_t) cols,
+                          (uint32_t) stride };
+    uint64_t payload = (uint64_t) rows * cols * sizeof(double);
+
+    memcpy(buffer, STREAM_MAGIC, 4);
+    memcpy(buffer + 4, words, sizeof(words));
+    memcpy(buffer + 24, &time, sizeof(time));
+    memcpy(buffer + 32, &payload, sizeof(payload));
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Fold a node into a max-abs pyramid level: each value of the
+ *             level is the signed value of largest magnitude in its 2 x 2
+ *             block. The top left node of a block, folded first, starts it.
+ * @parameter: level: Level to fold into
+ * @parameter: cols: Columns of the level
+ * @parameter: i: Row of the node in the level below
+ * @parameter: j: Column of the node in the level below
+ * @parameter: value: Node value
+ * @return:    N/A
+ *******************************************************************************
+ */
+static inline void foldMaxAbs(double* level, int cols, int i, int j, double value)
+{
+    double* target = &level[(i / 2) * cols + j / 2];
+    if (((i | j) & 1) == 0 || fabs(value) > fabs(*target))
+    {
+        *target = value;
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Fill a stream buffer with the header and decimated field, and
+ *             the pyramid levels after it. Level 1 is folded in the same pass
+ *             that copies the field, each later level from the one before.
+ * @parameter: stream: Stream
+ * @parameter: buffer: Buffer of a frame and its levels
+ * @parameter: frame: Time level to write
+ * @parameter: step: Time level index
+ * @parameter: time: Simulated time of the level
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void packFrame(const FrameStream* stream, unsigned char* buffer, FieldRef frame,
+                      uint32_t step, double time)
+{
+    packHeader(buffer, step, stream->rows, stream->cols, stream->stride, time);
+
+    double* out = (double*)(buffer + STREAM_HEADER_SIZE);
+    double* first = stream->levels > 0
+                    ? (double*)(buffer + stream->levelStart[1] + STREAM_HEADER_SIZE) : NULL;
+    for (int i = 0; i < stream->rows; i++)
+    {
+        for (int j = 0; j < stream->cols; j++)
+        {
+            double value = FIELD(frame, i * stream->stride, j * stream->stride);
+            *out++ = value;
+            if (first != NULL)
+            {
+                foldMaxAbs(first, stream->levelCols[1], i, j, value);
+            }
+        }
+    }
+
+    for (int k = 1; k <= stream->levels; k++)
+    {
+        unsigned char* start = buffer + stream->levelStart[k];
+        packHeader(start, step, stream->levelRows[k], stream->levelCols[k],
+                   stream->stride << k, time);
+        if (k == stream->levels)
+        {
+            break;
+        }
+
+        const double* below = (const double*)(start + STREAM_HEADER_SIZE);
+        double* above = (double*)(buffer + stream->levelStart[k + 1] + STREAM_HEADER_SIZE);
+        for (int i = 0; i < stream->levelRows[k]; i++)
+        {
+            for (int j = 0; j < stream->levelCols[k]; j++)
+            {
+                foldMaxAbs(above, stream->levelCols[k + 1], i, j,
+                           below[i * stream->levelCols[k] + j]);
+            }
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Queue a frame for the writer, applying the slow consumer
+ *             policy when every buffer is in use
+ * @parameter: stream: Stream
+ * @parameter: frame: Time level to write
+ * @parameter: grid: Grid constants
+ * @parameter: n: Time step that produced the level
+ * @return:    N/A
+ *******************************************************************************
+ */
+void streamFrame(FrameStream* stream, FieldRef frame, const WaveGrid* grid, int n)
+{
+    if ((n + 1) % stream->every != 0)
+    {
+        return;
+    }
+
+    // A frame needs a free buffer and a free queue slot. There is one more
+    // buffer than slots for the writer, but a writer that has not woken up
+    // yet holds none, so the buffers alone do not bound the queue.
+    pthread_mutex_lock(&stream->lock);
+    if (stream->policy == STREAM_BLOCK)
+    {
+        while ((stream->freeCount == 0 || stream->count == STREAM_QUEUE_DEPTH) && !stream->broken)
+        {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+    }
+    if (stream->broken)
+    {
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+
+    int index;
+    if (stream->freeCount > 0 && stream->count < STREAM_QUEUE_DEPTH)
+    {
+        index = stream->freeList[--stream->freeCount];
+    }
+    else if (stream->policy == STREAM_DROP)
+    {
+        stream->dropped++;
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+    else
+    {
+        // Coalesce: take back the newest queued frame and overwrite it
+        stream->count--;
+        index = stream->queue[(stream->head + stream->count) % STREAM_QUEUE_DEPTH];
+        stream->coalesced++;
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    packFrame(stream, stream->buffers[index], frame, (uint32_t)(n + 1),
+              (n + 1) * grid->timeStep);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->queue[(stream->head + stream->count) % STREAM_QUEUE_DEPTH] = index;
+    stream->count++;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Drain and close a frame stream and print its counters
+ * @parameter: stream: Stream to close
+ * @return:    N/A
+ *******************************************************************************
+ */
+void closeFrameStream(FrameStream* stream)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->closing = 1;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->writer, NULL);
+
+    fprintf(stderr, "stream: %ld frames written, %ld dropped, %ld coalesced%s\n",
+            stream->written, stream->dropped, stream->coalesced,
+            stream->broken ? ", consumer closed" : "");
+    for (int k = 1; k <= stream->levels; k++)
+    {
+        fprintf(stderr, "stream: level %d, %d x %d, %.1f KiB per frame\n", k,
+                stream->levelRows[k], stream->levelCols[k],
+                (stream->levelStart[k + 1] - stream->levelStart[k]) / 1024.0);
+        close(stream->levelFds[k - 1]);
+    }
+
+    if (stream->fd != STDOUT_FILENO)
+    {
+        close(stream->fd);
+    }
+    for (int b = 0; b < STREAM_QUEUE_DEPTH + 1; b++)
+    {
+        memFree(stream->buffers[b]);
+    }
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->changed);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Hand a finished time level to every enabled output
+ * @parameter: sink: Outputs
+ * @parameter: frame: Time level n+1
+ * @parameter: grid: Grid constants
+ * @parameter: n: Time step that produced the level
+ * @return:    N/A
+ *******************************************************************************
+ */
+void emitFrame(FrameSink* sink, FieldRef frame, const WaveGrid* grid, int n)
+{
+    if (sink->stream != NULL)
+    {
+        streamFrame(sink->stream, frame, grid, n);
+    }
+    if (sink->renderer != NULL)
+    {
+        renderFrame(sink->renderer, frame, grid->rows, grid->cols);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Discrete energy of the leapfrog scheme between two time levels,
+ *             which the interior update conserves exactly. Sums over the
+ *             interior, so it drops as waves leave through the boundaries.
+ * @parameter: next: Time level n+1
+ * @parameter: now: Time level n
+ * @parameter: grid: Grid constants
+ * @return:    Energy in grid units
+ *******************************************************************************
+ */
+double fieldEnergy(FieldRef next, FieldRef now, const WaveGrid* grid)
+{
+    double kinetic = 0.0;
+    double strain = 0.0;
+
+    for (int ii = 1; ii < grid->rows - 1; ii++)
+    {
+        for (int jj = 1; jj < grid->cols - 1; jj++)
+        {
+            double velocity = FIELD(next, ii, jj) - FIELD(now, ii, jj);
+            kinetic += velocity * velocity;
+            strain += grid->ox2 * (FIELD(next, ii + 1, jj) - FIELD(next, ii, jj))
+                                * (FIELD(now, ii + 1, jj) - FIELD(now, ii, jj))
+                      + grid->oy2 * (FIELD(next, ii, jj + 1) - FIELD(next, ii, jj))
+                                  * (FIELD(now, ii, jj + 1) - FIELD(now, ii, jj));
+        }
+    }
+
+    return 0.5 * (kinetic + strain);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Write a file through a temporary and rename it into place, so
+ *             readers never see a partly written file
+ * @parameter: path: Final path
+ * @parameter: text: File contents
+ * @return:    0 on success, -1 on failure
+ *******************************************************************************
+ */
+static int replaceFile(const char* path, const char* text)
+{
+    char temp[4096];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    FILE* out = fopen(temp, "w");
+    if (out == NULL)
+    {
+        return -1;
+    }
+    int failed = fputs(text, out) < 0;
+    failed |= fclose(out) != 0;
+    if (failed || rename(temp, path) != 0)
+    {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Write one snapshot of the metrics in the Prometheus textfile
+ *             collector format (PATH.prom) and as JSON (PATH.json)
+ * @parameter: metrics: Metrics export
+ * @parameter: rate: Steps per second over the last interval
+ * @return:    N/A
+ *******************************************************************************
+ */
+void writeMetrics(MetricsExport* metrics, double rate)
+{
+    int step = atomic_load(&metrics->step);
+    int energyStep = atomic_load(&metrics->energyStep);
+    double energy = atomic_load(&metrics->energy);
+    double eta = rate > 0.0 ? (metrics->totalSteps - step) / rate : -1.0;
+    int depth = 0;
+    if (metrics->stream != NULL)
+    {
+        pthread_mutex_lock(&metrics->stream->lock);
+        depth = metrics->stream->count;
+        pthread_mutex_unlock(&metrics->stream->lock);
+    }
+
+    char prom[4096];
+    char json[4096];
+    int p = 0;
+    int j = 0;
+    p += snprintf(prom + p, sizeof(prom) - p,
+                  "# HELP wave_step Time steps finished\n# TYPE wave_step gauge\nwave_step %d\n"
+                  "# HELP wave_steps Time steps in the run\n# TYPE wave_steps gauge\nwave_steps %d\n"
+                  "# HELP wave_simulated_time_seconds Simulated time reached\n"
+                  "# TYPE wave_simulated_time_seconds gauge\nwave_simulated_time_seconds %.9e\n"
+                  "# HELP wave_steps_per_second Steps per second over the last interval\n"
+                  "# TYPE wave_steps_per_second gauge\nwave_steps_per_second %.6g\n"
+                  "# HELP wave_cell_updates_per_second Cell updates per second over the last interval\n"
+                  "# TYPE wave_cell_updates_per_second gauge\nwave_cell_updates_per_second %.6g\n"
+                  "# HELP wave_eta_seconds Estimated time to finish, -1 if unknown\n"
+                  "# TYPE wave_eta_seconds gauge\nwave_eta_seconds %.3f\n"
+                  "# HELP wave_output_queue_depth Frames waiting for the stream writer\n"
+                  "# TYPE wave_output_queue_depth gauge\nwave_output_queue_depth %d\n"
+                  "# HELP wave_energy Discrete field energy, in grid units\n"
+                  "# TYPE wave_energy gauge\nwave_energy %.9e\n"
+                  "# HELP wave_energy_step Step the energy value belongs to\n"
+                  "# TYPE wave_energy_step gauge\nwave_energy_step %d\n"
+                  "# HELP wave_memory_bytes Live bytes per subsystem\n# TYPE wave_memory_bytes gauge\n",
+                  step, metrics->totalSteps, step * metrics->timeStep, rate,
+                  rate * metrics->cellsPerStep, eta, depth, energy, energyStep);
+    j += snprintf(json + j, sizeof(json) - j,
+                  "{\"step\": %d, \"steps\": %d, \"simulated_time\": %.9e, "
+                  "\"steps_per_second\": %.6g, \"cell_updates_per_second\": %.6g, "
+                  "\"eta_seconds\": %.3f, \"output_queue_depth\": %d, "
+                  "\"energy\": %.9e, \"energy_step\": %d, \"memory_bytes\": {",
+                  step, metrics->totalSteps, step * metrics->timeStep, rate,
+                  rate * metrics->cellsPerStep, eta, depth, energy, energyStep);
+    for (int t = 0; t <= MEM_TAG_COUNT; t++)
+    {
+        // The total would be counted twice by a sum over the subsystem label
+        long live = atomic_load(&memCounters[t].live);
+        if (t < MEM_TAG_COUNT)
+        {
+            p += snprintf(prom + p, sizeof(prom) - p, "wave_memory_bytes{subsystem=\"%s\"} %ld\n",
+                          memTagNames[t], live);
+        }
+        j += snprintf(json + j, sizeof(json) - j, "%s\"%s\": %ld", t > 0 ? ", " : "",
+                      memTagNames[t], live);
+    }
+    snprintf(json + j, sizeof(json) - j, "}}\n");
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.prom", metrics->path);
+    int failed = replaceFile(path, prom);
+    snprintf(path, sizeof(path), "%s.json", metrics->path);
+    failed |= replaceFile(path, json);
+    if (failed && !metrics->failed)
+    {
+        fprintf(stderr, "metrics: cannot write %s.prom/.json\n", metrics->path);
+        metrics->failed = 1;
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Metrics thread, writes a snapshot every interval and a last one
+ *             when the run stops. Asks the solver for a fresh energy value
+ *             each time, which it computes at the end of its next step.
+ * @parameter: arg: MetricsExport
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* metricsWriter(void* arg)
+{
+    MetricsExport* metrics = (MetricsExport*) arg;
+    int lastStep = 0;
+    double lastTime = metrics->start;
+
+    pthread_mutex_lock(&metrics->lock);
+    for (;;)
+    {
+        int stopping = metrics->stopping;
+        if (!stopping)
+        {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            double wake = until.tv_sec + until.tv_nsec * 1e-9 + metrics->interval;
+            until.tv_sec = (time_t) wake;
+            until.tv_nsec = (long)((wake - until.tv_sec) * 1e9);
+            pthread_cond_timedwait(&metrics->wake, &metrics->lock, &until);
+            stopping = metrics->stopping;
+        }
+        pthread_mutex_unlock(&metrics->lock);
+
+        // Rate over the last interval, or over the whole run for the final one
+        double now = wallTime();
+        int step = atomic_load(&metrics->step);
+        double rate = stopping ? step / (now - metrics->start)
+                               : (step - lastStep) / (now - lastTime);
+        writeMetrics(metrics, rate);
+        lastStep = step;
+        lastTime = now;
+        atomic_store(&metrics->energyWanted, 1);
+
+        if (stopping)
+        {
+            return NULL;
+        }
+        pthread_mutex_lock(&metrics->lock);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Start the metrics thread
+ * @parameter: metrics: Metrics export to fill
+ * @parameter: path: Base path of the PATH.prom and PATH.json files
+ * @parameter: interval: Seconds between snapshots
+ * @parameter: grid: Grid constants
+ * @parameter: steps: Time steps in the run
+ * @parameter: stream: Frame stream whose queue depth is reported, or NULL
+ * @return:    N/A
+ *******************************************************************************
+ */
+void startMetrics(MetricsExport* metrics, const char* path, double interval,
+                  const WaveGrid* grid, int steps, FrameStream* stream)
+{
+    metrics->path = path;
+    metrics->interval = interval;
+    metrics->totalSteps = steps;
+    metrics->cellsPerStep = (long)grid->rows * grid->cols;
+    metrics->timeStep = grid->timeStep;
+    metrics->stream = stream;
+    metrics->start = wallTime();
+    metrics->stopping = 0;
+    metrics->failed = 0;
+    atomic_init(&metrics->step, 0);
+    atomic_init(&metrics->energyWanted, 1);
+    atomic_init(&metrics->energyStep, 0);
+    atomic_init(&metrics->energy, 0.0);
+    pthread_mutex_init(&metrics->lock, NULL);
+    pthread_cond_init(&metrics->wake, NULL);
+    pthread_create(&metrics->writer, NULL, metricsWriter, metrics);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Take the metrics writer's request for an energy value, if any
+ * @parameter: metrics: Metrics export
+ * @return:    1 if the caller must compute the energy of this step
+ *******************************************************************************
+ */
+static int claimEnergyRequest(MetricsExport* metrics)
+{
+    return atomic_load_explicit(&metrics->energyWanted, memory_order_relaxed)
+           && atomic_exchange(&metrics->energyWanted, 0);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Hand a requested energy value to the metrics writer
+ * @parameter: metrics: Metrics export
+ * @parameter: energy: Energy between time levels n+1 and n
+ * @parameter: n: Time step index
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void storeEnergy(MetricsExport* metrics, double energy, int n)
+{
+    atomic_store(&metrics->energy, energy);
+    atomic_store(&metrics->energyStep, n + 1);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Report a finished step, two relaxed atomics unless the writer
+ *             asked for an energy value
+ * @parameter: metrics: Metrics export, or NULL when it is off
+ * @parameter: next: Time level n+1
+ * @parameter: now: Time level n
+ * @parameter: grid: Grid constants
+ * @parameter: n: Time step index
+ * @return:    N/A
+ *******************************************************************************
+ */
+void metricsStep(MetricsExport* metrics, FieldRef next, FieldRef now, const WaveGrid* grid,
+                 int n)
+{
+    if (metrics == NULL)
+    {
+        return;
+    }
+    if (claimEnergyRequest(metrics))
+    {
+        storeEnergy(metrics, fieldEnergy(next, now, grid), n);
+    }
+    atomic_store_explicit(&metrics->step, n + 1, memory_order_relaxed);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Write the last snapshot and stop the metrics thread
+ * @parameter: metrics: Metrics export
+ * @return:    N/A
+ *******************************************************************************
+ */
+void stopMetrics(MetricsExport* metrics)
+{
+    pthread_mutex_lock(&metrics->lock);
+    metrics->stopping = 1;
+    pthread_cond_signal(&metrics->wake);
+    pthread_mutex_unlock(&metrics->lock);
+    pthread_join(metrics->writer, NULL);
+
+    pthread_mutex_destroy(&metrics->lock);
+    pthread_cond_destroy(&metrics->wake);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Node range of a checkpoint tile, edge tiles are cut short
+ * @parameter: t: Tile index, row major
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @parameter: range: Filled with the first row, the row after the tile, the
+ *             first column and the column after the tile
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void tileRange(int t, int rows, int cols, int range[4])
+{
+    int tileCols = (cols + CHECKPOINT_TILE - 1) / CHECKPOINT_TILE;
+    range[0] = (t / tileCols) * CHECKPOINT_TILE;
+    range[1] = range[0] + CHECKPOINT_TILE < rows ? range[0] + CHECKPOINT_TILE : rows;
+    range[2] = (t % tileCols) * CHECKPOINT_TILE;
+    range[3] = range[2] + CHECKPOINT_TILE < cols ? range[2] + CHECKPOINT_TILE : cols;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Start a checkpoint chain. The first checkpoint of a run is
+ *             always a full one, so a chain can be continued by a run whose
+ *             saved state is unknown.
+ * @parameter: chain: Chain to fill
+ * @parameter: path: Chain file
+ * @parameter: grid: Grid constants
+ * @parameter: every: Steps between checkpoints
+ * @parameter: fullEvery: Every this many checkpoints is a full image
+ * @parameter: keep: Bytes of an existing chain to keep and append to, or -1
+ *             to start a new file
+ * @return:    0 on success, -1 if the file cannot be opened
+ *******************************************************************************
+ */
+int openCheckpoint(CheckpointChain* chain, const char* path, const WaveGrid* grid,
+                   int every, int fullEvery, long keep)
+{
+    memset(chain, 0, sizeof(*chain));
+    chain->rows = grid->rows;
+    chain->cols = grid->cols;
+    chain->tileCount = ((grid->rows + CHECKPOINT_TILE - 1) / CHECKPOINT_TILE)
+                       * ((grid->cols + CHECKPOINT_TILE - 1) / CHECKPOINT_TILE);
+    chain->every = every;
+    chain->fullEvery = fullEvery;
+
+    if (keep >= 0)
+    {
+        // Drop a record cut short by the interrupted run
+        chain->file = fopen(path, "r+b");
+        if (chain->file == NULL || ftruncate(fileno(chain->file), keep) != 0
+            || fseek(chain->file, keep, SEEK_SET) != 0)
+        {
+            perror(path);
+            if (chain->file != NULL)
+            {
+                fclose(chain->file);
+            }
+            return -1;
+        }
+    }
+    else
+    {
+        chain->file = fopen(path, "wb");
+        if (chain->file == NULL)
+        {
+            perror(path);
+            return -1;
+        }
+        uint32_t header[4] = { 0, (uint32_t) grid->rows, (uint32_t) grid->cols,
+                               CHECKPOINT_TILE };
+        memcpy(header, CHECKPOINT_MAGIC, 4);
+        fwrite(header, sizeof(header), 1, chain->file);
+    }
+
+    size_t nodes = (size_t) grid->rows * grid->cols;
+    chain->savedNow = (double*) memAlloc(nodes * sizeof(double), MEM_IO);
+    chain->savedPrev = (double*) memAlloc(nodes * sizeof(double), MEM_IO);
+    chain->dirty = (uint32_t*) memAlloc(chain->tileCount * sizeof(uint32_t), MEM_IO);
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Whether a tile of a time level differs bit for bit from the
+ *             state saved at the previous checkpoint
+ * @parameter: saved: Saved state, row major
+ * @parameter: field: Time level
+ * @parameter: cols: Nodes in y-direction
+ * @parameter: range: Node range of the tile
+ * @return:    1 if any node changed
+ *******************************************************************************
+ */
+static int tileChanged(const double* saved, FieldRef field, int cols, const int range[4])
+{
+    for (int i = range[0]; i < range[1]; i++)
+    {
+        for (int j = range[2]; j < range[3]; j++)
+        {
+            double value = FIELD(field, i, j);
+            if (memcmp(&value, &saved[(size_t)i * cols + j], sizeof(double)) != 0)
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Append a checkpoint of time levels n and n-1 to the chain: a
+ *             full image every fullEvery checkpoints, otherwise only the
+ *             tiles that changed since the previous checkpoint
+ * @parameter: chain: Checkpoint chain
+ * @parameter: now: Time level n
+ * @parameter: prev: Time level n-1
+ * @parameter: nextStep: Step a restored run continues with
+ * @return:    N/A
+ *******************************************************************************
+ */
+void writeCheckpoint(CheckpointChain* chain, FieldRef now, FieldRef prev, int nextStep)
+{
+    const int cols = chain->cols;
+    int full = (chain->taken % chain->fullEvery == 0);
+    int range[4];
+
+    uint32_t dirtyCount = 0;
+    for (int t = 0; t < chain->tileCount; t++)
+    {
+        tileRange(t, chain->rows, cols, range);
+        if (full || tileChanged(chain->savedNow, now, cols, range)
+            || tileChanged(chain->savedPrev, prev, cols, range))
+        {
+            chain->dirty[dirtyCount++] = (uint32_t) t;
+        }
+    }
+
+    // Record: kind, next step and tile count, then per tile its index and
+    // both time levels row by row
+    uint32_t header[3] = { full ? 0u : 1u, (uint32_t) nextStep, dirtyCount };
+    size_t bytes = fwrite(header, 1, sizeof(header), chain->file);
+    for (uint32_t d = 0; d < dirtyCount; d++)
+    {
+        tileRange((int) chain->dirty[d], chain->rows, cols, range);
+        bytes += fwrite(&chain->dirty[d], 1, sizeof(uint32_t), chain->file);
+        for (int level = 0; level < 2; level++)
+        {
+            FieldRef field = level == 0 ? now : prev;
+            double* saved = level == 0 ? chain->savedNow : chain->savedPrev;
+            for (int i = range[0]; i < range[1]; i++)
+            {
+                double* row = &saved[(size_t)i * cols];
+                for (int j = range[2]; j < range[3]; j++)
+                {
+                    row[j] = FIELD(field, i, j);
+                }
+                bytes += fwrite(row + range[2], 1, (range[3] - range[2]) * sizeof(double),
+                                chain->file);
+            }
+        }
+    }
+
+    // On disk before the run moves on
+    fflush(chain->file);
+    fsync(fileno(chain->file));
+
+    chain->taken++;
+    chain->fullCount += full;
+    chain->tilesWritten += dirtyCount;
+    chain->bytes += bytes;
+    chain->fullBytes += sizeof(header) + chain->tileCount * sizeof(uint32_t)
+                        + 2 * (size_t) chain->rows * cols * sizeof(double);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Report and close a checkpoint chain
+ * @parameter: chain: Checkpoint chain
+ * @parameter: report: Stream the report goes to
+ * @return:    N/A
+ *******************************************************************************
+ */
+void closeCheckpoint(CheckpointChain* chain, FILE* report)
+{
+    fprintf(report, "Checkpoints: %d (%d full), %ld of %ld tiles written, "
+            "%.1f KiB instead of %.1f KiB for full images\n",
+            chain->taken, chain->fullCount, chain->tilesWritten,
+            (long) chain->taken * chain->tileCount, chain->bytes / 1024.0,
+            chain->fullBytes / 1024.0);
+
+    fclose(chain->file);
+    memFree(chain->savedNow);
+    memFree(chain->savedPrev);
+    memFree(chain->dirty);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Read one checkpoint record
+ * @parameter: in: Chain file, positioned at the record
+ * @parameter: grid: Grid constants
+ * @parameter: now: Receives the tiles of time level n, or NULL to skip them
+ * @parameter: prev: Receives the tiles of time level n-1
+ * @parameter: buffer: Two tiles of scratch
+ * @parameter: record: Filled with the kind, next step and tile count
+ * @return:    1 if the record is complete, 0 at the end of the chain
+ *******************************************************************************
+ */
+static int readCheckpointRecord(FILE* in, const WaveGrid* grid, const FieldRef* now,
+                                const FieldRef* prev, double* buffer, uint32_t record[3])
+{
+    const int tileCount = ((grid->rows + CHECKPOINT_TILE - 1) / CHECKPOINT_TILE)
+                          * ((grid->cols + CHECKPOINT_TILE - 1) / CHECKPOINT_TILE);
+    if (fread(record, sizeof(uint32_t), 3, in) != 3 || record[0] > 1
+        || record[2] > (uint32_t) tileCount)
+    {
+        return 0;
+    }
+
+    for (uint32_t d = 0; d < record[2]; d++)
+    {
+        uint32_t t;
+        int range[4];
+        if (fread(&t, sizeof(t), 1, in) != 1 || t >= (uint32_t) tileCount)
+        {
+            return 0;
+        }
+        tileRange((int) t, grid->rows, grid->cols, range);
+        int width = range[3] - range[2];
+        size_t nodes = (size_t)(range[1] - range[0]) * width;
+        if (fread(buffer, sizeof(double), 2 * nodes, in) != 2 * nodes)
+        {
+            return 0;
+        }
+
+        if (now != NULL)
+        {
+            const double* value = buffer;
+            for (int level = 0; level < 2; level++)
+            {
+                FieldRef field = level == 0 ? *now : *prev;
+                for (int i = range[0]; i < range[1]; i++)
+                {
+                    for (int j = range[2]; j < range[3]; j++)
+                    {
+                        FIELD(field, i, j) = *value++;
+                    }
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Restore time levels n and n-1 by replaying a checkpoint chain
+ *             from its last full image through the deltas after it. A record
+ *             cut short by an interrupted run ends the chain.
+ * @parameter: path: Chain file
+ * @parameter: grid: Grid constants, must match the chain
+ * @parameter: now: Filled with time level n
+ * @parameter: prev: Filled with time level n-1
+ * @parameter: validEnd: Set to the bytes of complete records
+ * @return:    Step to continue with, or -1 without a usable chain
+ *******************************************************************************
+ */
+int restoreCheckpoint(const char* path, const WaveGrid* grid, FieldRef now, FieldRef prev,
+                      long* validEnd)
+{
+    FILE* in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    uint32_t header[4];
+    if (fread(header, sizeof(header), 1, in) != 1 || memcmp(header, CHECKPOINT_MAGIC, 4) != 0
+        || header[1] != (uint32_t) grid->rows || header[2] != (uint32_t) grid->cols
+        || header[3] != CHECKPOINT_TILE)
+    {
+        fprintf(stderr, "%s: not a checkpoint chain of a %d x %d grid\n", path,
+                grid->rows, grid->cols);
+        fclose(in);
+        return -1;
+    }
+
+    double* buffer = (double*) memAlloc(2 * CHECKPOINT_TILE * CHECKPOINT_TILE * sizeof(double),
+                                        MEM_IO);
+    uint32_t record[3];
+
+    // Find the last full image and the end of the last complete record, so
+    // only complete records are replayed into the fields
+    long base = -1;
+    long end = ftell(in);
+    int records = 0;
+    int deltas = 0;
+    for (;;)
+    {
+        long start = ftell(in);
+        if (!readCheckpointRecord(in, grid, NULL, NULL, buffer, record))
+        {
+            break;
+        }
+        if (record[0] == 0)
+        {
+            base = start;
+            deltas = 0;
+        }
+        else
+        {
+            deltas++;
+        }
+        end = ftell(in);
+        records++;
+    }
+
+    int step = -1;
+    if (base < 0)
+    {
+        fprintf(stderr, "%s: no complete full checkpoint\n", path);
+    }
+    else
+    {
+        fseek(in, base, SEEK_SET);
+        while (ftell(in) < end)
+        {
+            readCheckpointRecord(in, grid, &now, &prev, buffer, record);
+            step = (int) record[1];
+        }
+        fprintf(stderr, "Restored step %d from %s: a full image and %d deltas of %d "
+                "records\n", step, path, deltas, records);
+    }
+
+    fclose(in);
+    memFree(buffer);
+    *validEnd = end;
+    return step;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Links across the contour of a region: each node on the edge of
+ *             the region paired with a neighbour just outside it. Corner
+ *             nodes have two links.
+ * @parameter: region: First row, first column, row after and column after
+ * @parameter: inner: Filled with the node inside the region, or NULL
+ * @parameter: outer: Filled with the node outside the region, or NULL
+ * @parameter: axis: Filled with 0 for neighbours in x, 1 for neighbours in y,
+ *             or NULL
+ * @return:    Number of links
+ *******************************************************************************
+ */
+int regionLinks(const int region[4], GridNode* inner, GridNode* outer, int* axis)
+{
+    const int r0 = region[0];
+    const int c0 = region[1];
+    const int r1 = region[2];
+    const int c1 = region[3];
+    int count = 0;
+
+#define ADD_LINK(ii, jj, oi, oj, ax)                                     \
+    do                                                                 \
+    {                                                                  \
+        if (inner != NULL)                                             \
+        {                                                              \
+            inner[count] = (GridNode){ (ii), (jj) };                   \
+            outer[count] = (GridNode){ (oi), (oj) };                   \
+            axis[count] = (ax);                                        \
+        }                                                              \
+        count++;                                                       \
+    } while (0)
+
+    for (int jj = c0; jj < c1; jj++)
+    {
+        ADD_LINK(r0, jj, r0 - 1, jj, 0);
+        ADD_LINK(r1 - 1, jj, r1, jj, 0);
+    }
+    for (int ii = r0; ii < r1; ii++)
+    {
+        ADD_LINK(ii, c0, ii, c0 - 1, 1);
+        ADD_LINK(ii, c1 - 1, ii, c1, 1);
+    }
+
+#undef ADD_LINK
+    return count;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Start recording the field on both sides of a region's contour
+ * @parameter: record: Recording to fill
+ * @parameter: path: Output path
+ * @parameter: grid: Grid constants of the full run
+ * @parameter: region: Region as in regionLinks
+ * @parameter: steps: Steps of the run
+ * @return:    0 on success, -1 if the file cannot be opened
+ *******************************************************************************
+ */
+int openRegionRecord(RegionRecord* record, const char* path, const WaveGrid* grid,
+                     const int region[4], int steps)
+{
+    record->file = fopen(path, "wb");
+    if (record->file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    record->linkCount = regionLinks(region, NULL, NULL, NULL);
+    record->inner = (GridNode*) memAlloc(record->linkCount * sizeof(GridNode), MEM_PROBES);
+    record->outer = (GridNode*) memAlloc(record->linkCount * sizeof(GridNode), MEM_PROBES);
+    record->axis = (int*) memAlloc(record->linkCount * sizeof(int), MEM_PROBES);
+    record->values = (double*) memAlloc(2 * record->linkCount * sizeof(double), MEM_PROBES);
+    regionLinks(region, record->inner, record->outer, record->axis);
+
+    uint32_t header[8] = { 0, (uint32_t) grid->rows, (uint32_t) grid->cols,
+                           (uint32_t) region[0], (uint32_t) region[1], (uint32_t) region[2],
+                           (uint32_t) region[3], (uint32_t) steps };
+    memcpy(header, REPLAY_MAGIC, 4);
+    fwrite(header, sizeof(header), 1, record->file);
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Record time level n+1 on both sides of the contour: for each
+ *             link the inner value, then the outer value
+ * @parameter: record: Recording
+ * @parameter: next: Time level n+1
+ * @return:    N/A
+ *******************************************************************************
+ */
+void recordRegionStep(RegionRecord* record, FieldRef next)
+{
+    for (int k = 0; k < record->linkCount; k++)
+    {
+        record->values[2 * k] = FIELD(next, record->inner[k].row, record->inner[k].col);
+        record->values[2 * k + 1] = FIELD(next, record->outer[k].row, record->outer[k].col);
+    }
+    fwrite(record->values, sizeof(double), 2 * record->linkCount, record->file);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Close a contour recording
+ * @parameter: record: Recording
+ * @return:    N/A
+ *******************************************************************************
+ */
+void closeRegionRecord(RegionRecord* record)
+{
+    fclose(record->file);
+    memFree(record->inner);
+    memFree(record->outer);
+    memFree(record->axis);
+    memFree(record->values);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Re-simulate only the recorded region, with the recording
+ *             injected across its contour (total field / scattered field).
+ *             The region holds the total field, and a padding band around it
+ *             holds only the scattered field, which leaves through radiating
+ *             boundaries. Where the stencil crosses the contour, the recorded
+ *             field of the node on the other side is added (inside) or
+ *             subtracted (outside). So with nothing changed inside, the
+ *             region repeats the full run and the padding stays at rounding
+ *             level. --obstacle then changes the inside.
+ * @parameter: options: Command line options
+ * @return:    0 on success, 1 on a bad recording or obstacle
+ *******************************************************************************
+ */
+int runRegionReplay(const SimOptions* options)
+{
+    FILE* in = fopen(options->recordPath, "rb");
+    if (in == NULL)
+    {
+        perror(options->recordPath);
+        return 1;
+    }
+    uint32_t header[8];
+    if (fread(header, sizeof(header), 1, in) != 1 || memcmp(header, REPLAY_MAGIC, 4) != 0)
+    {
+        fprintf(stderr, "%s: not a region recording\n", options->recordPath);
+        fclose(in);
+        return 1;
+    }
+
+    const int fullRows = (int) header[1];
+    const int fullCols = (int) header[2];
+    const int region[4] = { (int) header[3], (int) header[4], (int) header[5], (int) header[6] };
+    const int height = region[2] - region[0];
+    const int width = region[3] - region[1];
+    const int pad = options->replayPadding;
+
+    // Every complete recorded step
+    const int links = regionLinks(region, NULL, NULL, NULL);
+    const size_t stepValues = 2 * (size_t) links;
+    double* recorded = (double*) memAlloc(header[7] * stepValues * sizeof(double), MEM_PROBES);
+    int steps = 0;
+    while (steps < (int) header[7]
+           && fread(recorded + steps * stepValues, sizeof(double), stepValues, in) == stepValues)
+    {
+        steps++;
+    }
+    fclose(in);
+
+    GridNode* inner = (GridNode*) memAlloc(links * sizeof(GridNode), MEM_PROBES);
+    GridNode* outer = (GridNode*) memAlloc(links * sizeof(GridNode), MEM_PROBES);
+    int* axis = (int*) memAlloc(links * sizeof(int), MEM_PROBES);
+    regionLinks(region, inner, outer, axis);
+
+    // Padded grid, in which region node (r0, c0) sits at (pad, pad)
+    WaveGrid grid = makeGrid(height + 2 * pad, width + 2 * pad);
+    int sourceInside = grid.srcRow >= region[0] && grid.srcRow < region[2]
+                       && grid.srcCol >= region[1] && grid.srcCol < region[3];
+    grid.srcRow += pad - region[0];
+    grid.srcCol += pad - region[1];
+    const int rows = grid.rows;
+    const int cols = grid.cols;
+    const double weight[2] = { grid.ox2, grid.oy2 };
+
+    const int* obstacle = options->obstacle;
+    if (obstacle[2] > 0
+        && (obstacle[0] - obstacle[2] <= region[0] || obstacle[0] + obstacle[2] >= region[2] - 1
+            || obstacle[1] - obstacle[2] <= region[1] || obstacle[1] + obstacle[2] >= region[3] - 1))
+    {
+        fprintf(stderr, "--obstacle must lie inside the recorded region %d,%d,%d,%d, clear of "
+                "its edge\n", region[0], region[1], region[2], region[3]);
+        memFree(recorded);
+        memFree(inner);
+        memFree(outer);
+        memFree(axis);
+        return 1;
+    }
+
+    FrameStream stream;
+    WaveGrid regionGrid = makeGrid(height, width);
+    int streaming = options->streamPath != NULL
+                    && openFrameStream(&stream, options->streamPath, &regionGrid,
+                                       options->streamEvery, options->streamStride,
+                                       options->streamLevels, options->streamPolicy) == 0;
+    double** window = (double**) memAlloc(height * sizeof(double*), MEM_PROBES);
+
+    double** Un_p1 = allocate2DArray(rows, cols);
+    double** Un0 = allocate2DArray(rows, cols);
+    double** Un_m1 = allocate2DArray(rows, cols);
+    initializeArray(Un_p1, rows, cols);
+    initializeArray(Un0, rows, cols);
+    initializeArray(Un_m1, rows, cols);
+    EdgeScratch scratch;
+    allocateEdgeScratch(&scratch, rows > cols ? rows : cols);
+
+    double contourError = 0.0;
+    double scattered = 0.0;
+    double start = wallTime();
+    for (int n = 0; n < steps; n++)
+    {
+        FieldRef next = { Un_p1, 1, 0 };
+        FieldRef now = { Un0, 1, 0 };
+        options->kernel(Un_p1, Un0, Un_m1, rows, cols, grid.ox2, grid.oy2);
+
+        // Level n of the full run is step n - 1 of the recording
+        if (n > 0)
+        {
+            const double* level = recorded + (n - 1) * stepValues;
+            for (int k = 0; k < links; k++)
+            {
+                Un_p1[inner[k].row - region[0] + pad][inner[k].col - region[1] + pad]
+                    += weight[axis[k]] * level[2 * k + 1];
+                Un_p1[outer[k].row - region[0] + pad][outer[k].col - region[1] + pad]
+                    -= weight[axis[k]] * level[2 * k];
+            }
+        }
+
+        // A disc held at zero, the total field vanishes on it
+        if (obstacle[2] > 0)
+        {
+            for (int ii = obstacle[0] - obstacle[2]; ii <= obstacle[0] + obstacle[2]; ii++)
+            {
+                for (int jj = obstacle[1] - obstacle[2]; jj <= obstacle[1] + obstacle[2]; jj++)
+                {
+                    int di = ii - obstacle[0];
+                    int dj = jj - obstacle[1];
+                    if (di * di + dj * dj <= obstacle[2] * obstacle[2])
+                    {
+                        Un_p1[ii - region[0] + pad][jj - region[1] + pad] = 0.0;
+                    }
+                }
+            }
+        }
+
+        if (sourceInside)
+        {
+            applySource(next, &grid, n);
+        }
+        applyBoundaries(next, now, &grid, &scratch);
+
+        // Inside the contour against the recording, and the largest
+        // scattered field in the padding
+        const double* level = recorded + n * stepValues;
+        for (int k = 0; k < links; k++)
+        {
+            double value = Un_p1[inner[k].row - region[0] + pad][inner[k].col - region[1] + pad];
+            contourError = fmax(contourError, fabs(value - level[2 * k]));
+        }
+        for (int ii = 0; ii < rows; ii++)
+        {
+            for (int jj = 0; jj < cols; jj++)
+            {
+                if (ii < pad || ii >= pad + height || jj < pad || jj >= pad + width)
+                {
+                    scattered = fmax(scattered, fabs(Un_p1[ii][jj]));
+                }
+            }
+        }
+
+        if (streaming)
+        {
+            for (int i = 0; i < height; i++)
+            {
+                window[i] = Un_p1[pad + i] + pad;
+            }
+            streamFrame(&stream, (FieldRef){ window, 1, 0 }, &regionGrid, n);
+        }
+
+        double** temp = Un_m1;
+        Un_m1 = Un0;
+        Un0 = Un_p1;
+        Un_p1 = temp;
+    }
+    double elapsed = wallTime() - start;
+
+    long fullNodes = (long) fullRows * fullCols;
+    printf("Replayed region rows %d..%d, cols %d..%d of the %d x %d grid with %d nodes of "
+           "padding\n", region[0], region[2] - 1, region[1], region[3] - 1, fullRows, fullCols,
+           pad);
+    printf("%d steps in %.3f s, %d nodes per step instead of %ld (%.1f%%)\n", steps, elapsed,
+           rows * cols, fullNodes, 100.0 * rows * cols / fullNodes);
+    if (obstacle[2] > 0)
+    {
+        printf("Obstacle at %d,%d, radius %d: contour differs from the recording by up to "
+               "%.3e, scattered field up to %.3e\n", obstacle[0], obstacle[1], obstacle[2],
+               contourError, scattered);
+    }
+    else
+    {
+        printf("Unchanged region: contour differs from the recording by up to %.3e, "
+               "scattered field up to %.3e\n", contourError, scattered);
+    }
+
+    if (streaming)
+    {
+        closeFrameStream(&stream);
+    }
+    free2DArray(Un_p1, rows);
+    free2DArray(Un0, rows);
+    free2DArray(Un_m1, rows);
+    freeEdgeScratch(&scratch);
+    memFree(window);
+    memFree(recorded);
+    memFree(inner);
+    memFree(outer);
+    memFree(axis);
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Spin until an atomic counter reaches a target, yielding the CPU
+ *             so oversubscribed runs still make progress
+ * @parameter: counter: Counter to watch
+ * @parameter: target: Value to wait for
+ * @return:    N/A
+ *******************************************************************************
+ */
+static inline void waitForCount(atomic_long* counter, long target)
+{
+    int spins = 0;
+    while (atomic_load_explicit(counter, memory_order_acquire) < target)
+    {
+        if (++spins > 64)
+        {
+            sched_yield();
+            spins = 0;
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Ring buffer holding time level L (level 0 is the first Un0,
+ *             level -1 the first Un_m1)
+ * @parameter: pipe: Pipeline
+ * @parameter: level: Time level
+ * @return:    2D array of that level
+ *******************************************************************************
+ */
+static inline double** pipelineLevel(Pipeline* pipe, int level)
+{
+    return pipe->levels[(level + 1) % pipe->ringSize];
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Pipelined worker. Thread k computes steps k, k + T, k + 2T, ...
+ *             Band b of step n starts once step n - 1 has finished bands
+ *             0 .. b + 1, which covers the halo rows it reads. With T + 2
+ *             ring buffers the level being overwritten was last read by this
+ *             thread's own previous step, so no other waits are needed.
+ * @parameter: arg: PipelineWorker
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* pipelineWorker(void* arg)
+{
+    PipelineWorker* worker = (PipelineWorker*) arg;
+    Pipeline* pipe = worker->pipeline;
+    int k = worker->index;
+    int T = pipe->threadCount;
+    long bands = pipe->bandCount;
+    atomic_long* mine = &pipe->progress[k].done;
+    atomic_long* before = &pipe->progress[(k + T - 1) % T].done;
+
+    EdgeScratch scratch;
+    const WaveGrid* grid = &pipe->grid;
+    allocateEdgeScratch(&scratch, grid->rows > grid->cols ? grid->rows : grid->cols);
+
+    for (int n = k; n < pipe->steps; n += T)
+    {
+        double** Un_p1 = pipelineLevel(pipe, n + 1);
+        double** Un0 = pipelineLevel(pipe, n);
+        double** Un_m1 = pipelineLevel(pipe, n - 1);
+
+        // Do not overwrite a frame the consumer has not taken yet
+        if (pipe->sink != NULL)
+        {
+            waitForCount(&pipe->consumed, n - pipe->ringSize + 1);
+        }
+
+        for (int b = 0; b < bands; b++)
+        {
+            if (n > 0)
+            {
+                long need = b + 2 < bands ? b + 2 : bands;
+                waitForCount(before, (long)(n - 1) * bands + need);
+            }
+
+            int r0 = b * pipe->bandRows;
+            int r1 = r0 + pipe->bandRows < grid->rows ? r0 + pipe->bandRows : grid->rows;
+            stepBand(grid, Un_p1, Un0, Un_m1, r0, r1, n, pipe->kernel, &scratch);
+
+            atomic_store_explicit(mine, (long) n * bands + b + 1, memory_order_release);
+        }
+    }
+
+    freeEdgeScratch(&scratch);
+    return NULL;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Set up a pipeline and its zeroed ring of time levels
+ * @parameter: pipe: Pipeline to fill
+ * @parameter: grid: Grid constants
+ * @parameter: steps: Number of time steps
+ * @parameter: threads: Number of worker threads
+ * @parameter: kernel: Interior update kernel
+ * @parameter: sink: Consumer of each frame, or NULL
+ * @return:    N/A
+ *******************************************************************************
+ */
+void initPipeline(Pipeline* pipe, const WaveGrid* grid, int steps, int threads,
+                  InteriorKernel kernel, FrameSink* sink)
+{
+    int rows = grid->rows;
+    int cols = grid->cols;
+    pipe->grid = *grid;
+    pipe->steps = steps;
+    pipe->threadCount = threads;
+    pipe->ringSize = threads + 2;
+    pipe->bandRows = PIPELINE_BAND_ROWS;
+    pipe->bandCount = (rows + PIPELINE_BAND_ROWS - 1) / PIPELINE_BAND_ROWS;
+    pipe->kernel = kernel;
+    pipe->sink = sink;
+    atomic_init(&pipe->consumed, 0);
+
+    pipe->levels = (double***) memAlloc(pipe->ringSize * sizeof(double**), MEM_RUNTIME);
+    for (int r = 0; r < pipe->ringSize; r++)
+    {
+        pipe->levels[r] = allocate2DArray(rows, cols);
+        initializeArray(pipe->levels[r], rows, cols);
+    }
+
+    pipe->progress = (BandProgress*) memAlloc(threads * sizeof(BandProgress), MEM_RUNTIME);
+    for (int t = 0; t < threads; t++)
+    {
+        atomic_init(&pipe->progress[t].done, 0);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free a pipeline
+ * @parameter: pipe: Pipeline to free
+ * @return:    N/A
+ *******************************************************************************
+ */
+void freePipeline(Pipeline* pipe)
+{
+    for (int r = 0; r < pipe->ringSize; r++)
+    {
+        free2DArray(pipe->levels[r], pipe->grid.rows);
+    }
+    memFree(pipe->levels);
+    memFree(pipe->progress);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Run all steps of a pipeline. Without a sink this returns when
+ *             every step is done; with one, frames are emitted on the calling
+ *             thread in step order as each step completes.
+ * @parameter: pipe: Initialized pipeline
+ * @return:    N/A
+ *******************************************************************************
+ */
+void runPipeline(Pipeline* pipe)
+{
+    pthread_t threads[PIPELINE_MAX_THREADS];
+    PipelineWorker workers[PIPELINE_MAX_THREADS];
+
+    for (int t = 0; t < pipe->threadCount; t++)
+    {
+        workers[t].pipeline = pipe;
+        workers[t].index = t;
+        pthread_create(&threads[t], NULL, pipelineWorker, &workers[t]);
+    }
+
+    if (pipe->sink != NULL)
+    {
+        for (int n = 0; n < pipe->steps; n++)
+        {
+            waitForCount(&pipe->progress[n % pipe->threadCount].done,
+                         (long)(n + 1) * pipe->bandCount);
+            emitFrame(pipe->sink, (FieldRef){ pipelineLevel(pipe, n + 1), 1, 0 },
+                      &pipe->grid, n);
+            atomic_store_explicit(&pipe->consumed, n + 1, memory_order_release);
+        }
+    }
+
+    for (int t = 0; t < pipe->threadCount; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Allocate a zeroed slice state
+ * @parameter: state: State to fill
+ * @parameter: grid: Grid constants
+ * @return:    N/A
+ *******************************************************************************
+ */
+void allocateState(SliceState* state, const WaveGrid* grid)
+{
+    state->Un0 = allocate2DArray(grid->rows, grid->cols);
+    state->Un_m1 = allocate2DArray(grid->rows, grid->cols);
+    initializeArray(state->Un0, grid->rows, grid->cols);
+    initializeArray(state->Un_m1, grid->rows, grid->cols);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free a slice state
+ * @parameter: state: State to free
+ * @parameter: grid: Grid constants
+ * @return:    N/A
+ *******************************************************************************
+ */
+void freeState(SliceState* state, const WaveGrid* grid)
+{
+    free2DArray(state->Un0, grid->rows);
+    free2DArray(state->Un_m1, grid->rows);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Copy one slice state into another
+ * @parameter: dst: Destination state
+ * @parameter: src: Source state
+ * @parameter: grid: Grid constants
+ * @return:    N/A
+ *******************************************************************************
+ */
+void copyState(SliceState* dst, const SliceState* src, const WaveGrid* grid)
+{
+    for (int i = 0; i < grid->rows; i++)
+    {
+        memcpy(dst->Un0[i], src->Un0[i], grid->cols * sizeof(double));
+        memcpy(dst->Un_m1[i], src->Un_m1[i], grid->cols * sizeof(double));
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Fine propagator: run the full scheme over a slice
+ * @parameter: grid: Grid constants
+ * @parameter: kernel: Interior update kernel
+ * @parameter: in: State at the slice start
+ * @parameter: out: Filled with the state at the slice end
+ * @parameter: firstStep: Step index at the slice start
+ * @parameter: stepCount: Number of steps
+ * @return:    N/A
+ *******************************************************************************
+ */
+void propagateFine(const WaveGrid* grid, InteriorKernel kernel, const SliceState* in,
+                   SliceState* out, int firstStep, int stepCount)
+{
+    SliceState work;
+    allocateState(&work, grid);
+    copyState(&work, in, grid);
+    double** Un_p1 = allocate2DArray(grid->rows, grid->cols);
+    initializeArray(Un_p1, grid->rows, grid->cols);
+
+    EdgeScratch scratch;
+    allocateEdgeScratch(&scratch, grid->rows > grid->cols ? grid->rows : grid->cols);
+
+    double** Un0 = work.Un0;
+    double** Un_m1 = work.Un_m1;
+    for (int n = firstStep; n < firstStep + stepCount; n++)
+    {
+        stepBand(grid, Un_p1, Un0, Un_m1, 0, grid->rows, n, kernel, &scratch);
+        double** temp = Un_m1;
+        Un_m1 = Un0;
+        Un0 = Un_p1;
+        Un_p1 = temp;
+    }
+
+    work.Un0 = Un0;
+    work.Un_m1 = Un_m1;
+    copyState(out, &work, grid);
+    freeState(&work, grid);
+    free2DArray(Un_p1, grid->rows);
+    freeEdgeScratch(&scratch);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Grid that is coarser by a factor in space and time. The Courant
+ *             numbers and boundary coefficients are unchanged.
+ * @parameter: fine: Fine grid constants
+ * @parameter: factor: Coarsening factor
+ * @return:    Coarse grid constants
+ *******************************************************************************
+ */
+WaveGrid coarsenGrid(const WaveGrid* fine, int factor)
+{
+    WaveGrid coarse = *fine;
+    coarse.rows = (fine->rows - 1) / factor + 1;
+    coarse.cols = (fine->cols - 1) / factor + 1;
+    coarse.timeStep = fine->timeStep * factor;
+    coarse.srcRow = fine->srcRow / factor;
+    coarse.srcCol = fine->srcCol / factor;
+    return coarse;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Bilinear sample of a coarse array at a fine node, clamped to
+ *             the coarse grid
+ * @parameter: array: Coarse array
+ * @parameter: coarse: Coarse grid constants
+ * @parameter: i, j: Fine node
+ * @parameter: factor: Coarsening factor
+ * @return:    Interpolated value
+ *******************************************************************************
+ */
+static double sampleCoarse(double** array, const WaveGrid* coarse, int i, int j,
+                           int factor)
+{
+    int ci = i / factor;
+    int cj = j / factor;
+    double fi = (double)(i % factor) / factor;
+    double fj = (double)(j % factor) / factor;
+    int ci1 = ci + 1 < coarse->rows ? ci + 1 : ci;
+    int cj1 = cj + 1 < coarse->cols ? cj + 1 : cj;
+    if (ci >= coarse->rows)
+    {
+        ci = ci1 = coarse->rows - 1;
+    }
+    if (cj >= coarse->cols)
+    {
+        cj = cj1 = coarse->cols - 1;
+    }
+
+    return (1 - fi) * ((1 - fj) * array[ci][cj] + fj * array[ci][cj1])
+           + fi * ((1 - fj) * array[ci1][cj] + fj * array[ci1][cj1]);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Coarse propagator: restrict to the coarse grid, run the scheme
+ *             there with the larger time step and interpolate back. Time
+ *             level n - factor is extrapolated from n and n-1 on the way in,
+ *             and level n-1 interpolated from n and n - factor on the way out.
+ * @parameter: grid: Fine grid constants
+ * @parameter: coarse: Coarse grid constants
+ * @parameter: kernel: Interior update kernel
+ * @parameter: in: Fine state at the slice start
+ * @parameter: out: Filled with the fine state at the slice end
+ * @parameter: firstStep: Fine step index at the slice start, a multiple of
+ *             the factor
+ * @parameter: stepCount: Number of fine steps
+ * @return:    N/A
+ *******************************************************************************
+ */
+void propagateCoarse(const WaveGrid* grid, const WaveGrid* coarse, InteriorKernel kernel,
+                     const SliceState* in, SliceState* out, int firstStep, int stepCount)
+{
+    const int f = PARAREAL_COARSEN;
+    SliceState small;
+    SliceState result;
+    allocateState(&small, coarse);
+    allocateState(&result, coarse);
+
+    for (int i = 0; i < coarse->rows; i++)
+    {
+        for (int j = 0; j < coarse->cols; j++)
+        {
+            double now = in->Un0[f * i][f * j];
+            small.Un0[i][j] = now;
+            small.Un_m1[i][j] = now - f * (now - in->Un_m1[f * i][f * j]);
+        }
+    }
+
+    propagateFine(coarse, kernel, &small, &result, firstStep / f, (stepCount + f / 2) / f);
+
+    for (int i = 0; i < grid->rows; i++)
+    {
+        for (int j = 0; j < grid->cols; j++)
+        {
+            double now = sampleCoarse(result.Un0, coarse, i, j, f);
+            double before = sampleCoarse(result.Un_m1, coarse, i, j, f);
+            out->Un0[i][j] = now;
+            out->Un_m1[i][j] = now - (now - before) / f;
+        }
+    }
+
+    freeState(&small, coarse);
+    freeState(&result, coarse);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Thread entry for a fine slice propagation
+ * @parameter: arg: SliceJob
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* sliceWorker(void* arg)
+{
+    SliceJob* job = (SliceJob*) arg;
+    struct timespec t0;
+    struct timespec t1;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+    propagateFine(job->grid, job->kernel, job->in, job->out, job->firstStep, job->stepCount);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+
+    job->cpuTime = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    return NULL;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Largest absolute difference between the time level n fields of
+ *             two states
+ * @parameter: a, b: States to compare
+ * @parameter: grid: Grid constants
+ * @return:    Maximum absolute difference
+ *******************************************************************************
+ */
+double stateDifference(const SliceState* a, const SliceState* b, const WaveGrid* grid)
+{
+    double diff = 0.0;
+    for (int i = 0; i < grid->rows; i++)
+    {
+        for (int j = 0; j < grid->cols; j++)
+        {
+            double d = fabs(a->Un0[i][j] - b->Un0[i][j]);
+            diff = d > diff ? d : diff;
+        }
+    }
+    return diff;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Parallel-in-time run with Parareal. The steps are split into
+ *             slices; each iteration runs the fine propagator on all open
+ *             slices in parallel and then sweeps the coarse propagator
+ *             serially with the correction U[j+1] = G(U[j]) + F(U[j]) - G_old.
+ *             Stops when the slice states change less than the tolerance,
+ *             and reports accuracy and speedup against serial time marching.
+ * @parameter: grid: Grid constants
+ * @parameter: kernel: Interior update kernel
+ * @parameter: steps: Total number of time steps
+ * @parameter: slices: Number of time slices, one fine thread each
+ * @return:    0 on success
+ *******************************************************************************
+ */
+int runParareal(const WaveGrid* grid, InteriorKernel kernel, int steps, int slices)
+{
+    const int f = PARAREAL_COARSEN;
+    WaveGrid coarse = coarsenGrid(grid, f);
+
+    // Slice lengths are multiples of the coarsening factor where possible
+    int sliceSteps = f * ((steps + f * slices - 1) / (f * slices));
+    int first[PARAREAL_MAX_SLICES];
+    int count[PARAREAL_MAX_SLICES];
+    for (int j = 0; j < slices; j++)
+    {
+        first[j] = j * sliceSteps < steps ? j * sliceSteps : steps;
+        count[j] = (first[j] + sliceSteps < steps ? first[j] + sliceSteps : steps) - first[j];
+    }
+
+    // Serial reference
+    SliceState start;
+    SliceState serial;
+    allocateState(&start, grid);
+    allocateState(&serial, grid);
+    double t0 = wallTime();
+    propagateFine(grid, kernel, &start, &serial, 0, steps);
+    double serialTime = wallTime() - t0;
+
+    // U[j] is the state at the start of slice j, U[slices] the final state
+    SliceState U[PARAREAL_MAX_SLICES + 1];
+    SliceState coarseOld[PARAREAL_MAX_SLICES];
+    SliceState fineOut[PARAREAL_MAX_SLICES];
+    SliceState coarseNew;
+    for (int j = 0; j <= slices; j++)
+    {
+        allocateState(&U[j], grid);
+    }
+    for (int j = 0; j < slices; j++)
+    {
+        allocateState(&coarseOld[j], grid);
+        allocateState(&fineOut[j], grid);
+    }
+    allocateState(&coarseNew, grid);
+
+    // Initial guess from a serial coarse sweep
+    t0 = wallTime();
+    for (int j = 0; j < slices; j++)
+    {
+        propagateCoarse(grid, &coarse, kernel, &U[j], &coarseOld[j], first[j], count[j]);
+        copyState(&U[j + 1], &coarseOld[j], grid);
+    }
+    double coarseTime = wallTime() - t0;
+    double projected = coarseTime;
+
+    printf("%-10s %12s %12s\n", "iteration", "change", "error");
+
+    int iteration = 0;
+    double parallelTime = coarseTime;
+    for (int k = 1; k <= slices; k++)
+    {
+        iteration = k;
+
+        // Fine propagation of the slices that are not exact yet
+        pthread_t threads[PARAREAL_MAX_SLICES];
+        SliceJob jobs[PARAREAL_MAX_SLICES];
+        t0 = wallTime();
+        for (int j = k - 1; j < slices; j++)
+        {
+            jobs[j] = (SliceJob){ grid, kernel, first[j], count[j], &U[j], &fineOut[j], 0.0 };
+            pthread_create(&threads[j], NULL, sliceWorker, &jobs[j]);
+        }
+        double slowest = 0.0;
+        for (int j = k - 1; j < slices; j++)
+        {
+            pthread_join(threads[j], NULL);
+            slowest = jobs[j].cpuTime > slowest ? jobs[j].cpuTime : slowest;
+        }
+        double fineTime = wallTime() - t0;
+
+        // Serial coarse sweep with the Parareal correction
+        t0 = wallTime();
+        double change = 0.0;
+        double scale = 0.0;
+        for (int j = k - 1; j < slices; j++)
+        {
+            propagateCoarse(grid, &coarse, kernel, &U[j], &coarseNew, first[j], count[j]);
+            for (int i = 0; i < grid->rows; i++)
+            {
+                for (int jj = 0; jj < grid->cols; jj++)
+                {
+                    double now = coarseNew.Un0[i][jj] + fineOut[j].Un0[i][jj]
+                                 - coarseOld[j].Un0[i][jj];
+                    double before = coarseNew.Un_m1[i][jj] + fineOut[j].Un_m1[i][jj]
+                                    - coarseOld[j].Un_m1[i][jj];
+                    double d = fabs(now - U[j + 1].Un0[i][jj]);
+                    change = d > change ? d : change;
+                    scale = fabs(now) > scale ? fabs(now) : scale;
+                    U[j + 1].Un0[i][jj] = now;
+                    U[j + 1].Un_m1[i][jj] = before;
+                }
+            }
+            copyState(&coarseOld[j], &coarseNew, grid);
+        }
+        double sweepTime = wallTime() - t0;
+
+        parallelTime += fineTime + sweepTime;
+        projected += slowest + sweepTime;
+
+        double relative = scale > 0.0 ? change / scale : 0.0;
+        printf("%-10d %12.3e %12.3e\n", k, relative,
+               stateDifference(&U[slices], &serial, grid));
+        if (relative < PARAREAL_TOLERANCE)
+        {
+            break;
+        }
+    }
+
+    double error = stateDifference(&U[slices], &serial, grid);
+    printf("\nslices %d, iterations %d, final max error %.3e\n", slices, iteration, error);
+    printf("serial   %10.4f s\n", serialTime);
+    printf("parareal %10.4f s  measured speedup %.2fx\n", parallelTime,
+           serialTime / parallelTime);
+    printf("         %10.4f s  with %d cores     %.2fx\n", projected, slices,
+           serialTime / projected);
+
+    for (int j = 0; j <= slices; j++)
+    {
+        freeState(&U[j], grid);
+    }
+    for (int j = 0; j < slices; j++)
+    {
+        freeState(&coarseOld[j], grid);
+        freeState(&fineOut[j], grid);
+    }
+    freeState(&coarseNew, grid);
+    freeState(&start, grid);
+    freeState(&serial, grid);
+
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Fill the interior of a 2D array with deterministic pseudo-random
+ *             values so the benchmark does not run on zeros or denormals. The
+ *             boundary is zeroed so every layout sees the same edge values.
+ * @parameter: array: 2D array pointer reference
+ * @parameter: rows: Number of rows
+ * @parameter: cols: Number of columns
+ * @parameter: seed: Generator seed
+ * @return:    N/A
+ *******************************************************************************
+ */
+void fillRandomArray(double** array, int rows, int cols, unsigned int seed)
+{
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            int edge = (i == 0 || j == 0 || i == rows - 1 || j == cols - 1);
+            array[i][j] = edge ? 0.0 : (seed >> 8) * (1.0 / 16777216.0) - 0.5;
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Time one interior kernel on an n x n grid with a given row
+ *             stride
+ * @parameter: kernel: Kernel to time
+ * @parameter: n: Grid size in each direction
+ * @parameter: stride: Doubles from one row to the next, at least n
+ * @parameter: steps: Number of time steps to run
+ * @parameter: result: Filled with the final field checksum
+ * @return:    Cell updates per second
+ *******************************************************************************
+ */
+double benchKernelStrided(InteriorKernel kernel, int n, int stride, int steps, double* result)
+{
+    double** Un_p1 = allocateStrided(n, stride);
+    double** Un0 = allocateStrided(n, stride);
+    double** Un_m1 = allocateStrided(n, stride);
+
+    initializeArray(Un_p1, n, n);
+    fillRandomArray(Un0, n, n, 1u);
+    fillRandomArray(Un_m1, n, n, 2u);
+
+    // Keep the scheme stable but away from the trivial zero solution
+    const double ox2 = 0.25;
+    const double oy2 = 0.25;
+
+    double start = wallTime();
+    for (int s = 0; s < steps; s++)
+    {
+        kernel(Un_p1, Un0, Un_m1, n, n, ox2, oy2);
+
+        double** temp = Un_m1;
+        Un_m1 = Un0;
+        Un0 = Un_p1;
+        Un_p1 = temp;
+    }
+    double elapsed = wallTime() - start;
+
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            sum += Un0[i][j];
+        }
+    }
+    *result = sum;
+
+    free2DArray(Un_p1, n);
+    free2DArray(Un0, n);
+    free2DArray(Un_m1, n);
+
+    return (double)(n - 2) * (n - 2) * steps / elapsed;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Time one interior kernel on an n x n grid
+ * @parameter: kernel: Kernel to time
+ * @parameter: n: Grid size in each direction
+ * @parameter: steps: Number of time steps to run
+ * @parameter: result: Filled with the final field checksum
+ * @return:    Cell updates per second
+ *******************************************************************************
+ */
+double benchKernel(InteriorKernel kernel, int n, int steps, double* result)
+{
+    return benchKernelStrided(kernel, n, rowStride(n), steps, result);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Time the interleaved layout on an n x n grid, starting from the
+ *             same fields as benchKernel
+ * @parameter: n: Grid size in each direction
+ * @parameter: steps: Number of time steps to run
+ * @parameter: result: Filled with the final field checksum
+ * @return:    Cell updates per second
+ *******************************************************************************
+ */
+double benchInterleaved(int n, int steps, double* result)
+{
+    double** Un0 = allocate2DArray(n, n);
+    double** Un_m1 = allocate2DArray(n, n);
+    double** U = allocate2DArray(n, 2 * n);
+
+    fillRandomArray(Un0, n, n, 1u);
+    fillRandomArray(Un_m1, n, n, 2u);
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            U[i][2 * j] = Un0[i][j];
+            U[i][2 * j + 1] = Un_m1[i][j];
+        }
+    }
+
+    const double ox2 = 0.25;
+    const double oy2 = 0.25;
+
+    int cur = 0;
+    double start = wallTime();
+    for (int s = 0; s < steps; s++)
+    {
+        updateInteriorInterleaved(U, n, n, cur, ox2, oy2);
+        cur = 1 - cur;
+    }
+    double elapsed = wallTime() - start;
+
+    double sum = 0.0;
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            sum += U[i][2 * j + cur];
+        }
+    }
+    *result = sum;
+
+    free2DArray(Un0, n);
+    free2DArray(Un_m1, n);
+    free2DArray(U, n);
+
+    return (double)(n - 2) * (n - 2) * steps / elapsed;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Time the boundary stage on a rows x cols grid
+ * @parameter: rows: Number of rows
+ * @parameter: cols: Number of cols
+ * @return:    Nanoseconds per edge node
+ *******************************************************************************
+ */
+double benchBoundaries(int rows, int cols)
+{
+    double** Un_p1 = allocate2DArray(rows, cols);
+    double** Un0 = allocate2DArray(rows, cols);
+    fillRandomArray(Un_p1, rows, cols, 3u);
+    fillRandomArray(Un0, rows, cols, 4u);
+
+    EdgeScratch scratch;
+    allocateEdgeScratch(&scratch, rows > cols ? rows : cols);
+
+    FieldRef next = { Un_p1, 1, 0 };
+    FieldRef now = { Un0, 1, 0 };
+    WaveGrid grid = makeGrid(rows, cols);
+    const int repeats = 2000;
+
+    double start = wallTime();
+    for (int r = 0; r < repeats; r++)
+    {
+        applyBoundaries(next, now, &grid, &scratch);
+    }
+    double elapsed = wallTime() - start;
+
+    freeEdgeScratch(&scratch);
+    free2DArray(Un_p1, rows);
+    free2DArray(Un0, rows);
+
+    return elapsed * 1e9 / ((2.0 * rows + 2.0 * cols) * repeats);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Benchmark every interior kernel at L1-, L2- and DRAM-resident
+ *             grid sizes and print the throughput table
+ * @parameter: N/A
+ * @return:    0 on success, 1 if a kernel disagrees with the scalar one
+ *******************************************************************************
+ */
+int runBenchmark(void)
+{
+    // Three time levels of n*n doubles: ~24 KiB, ~600 KiB and ~100 MiB
+    const struct { const char* label; int n; } sizes[] =
+    {
+        { "L1",   32   },
+        { "L2",   160  },
+        { "DRAM", 2048 },
+    };
+    int status = 0;
+
+    printf("%-6s %6s %-8s %10s %12s %10s %10s\n",
+           "level", "n", "kernel", "steps", "Mcells/s", "speedup", "peak MiB");
+
+    for (int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+    {
+        int n = sizes[s].n;
+        int steps = (int)(BENCH_CELL_UPDATES / ((double)n * n));
+        if (steps < BENCH_MIN_STEPS)
+        {
+            steps = BENCH_MIN_STEPS;
+        }
+
+        double baseRate = 0.0;
+        double baseResult = 0.0;
+        for (int k = 0; k < KERNEL_COUNT; k++)
+        {
+            double result;
+            memResetPeaks();
+            double rate = benchKernel(kernelTable[k].kernel, n, steps, &result);
+            if (k == 0)
+            {
+                baseRate = rate;
+                baseResult = result;
+            }
+            else if (result != baseResult)
+            {
+                fprintf(stderr, "kernel %s disagrees with %s at n=%d\n",
+                        kernelTable[k].name, kernelTable[0].name, n);
+                status = 1;
+            }
+
+            printf("%-6s %6d %-8s %10d %12.1f %9.2fx %10.2f\n", sizes[s].label, n,
+                   kernelTable[k].name, steps, rate * 1e-6, rate / baseRate,
+                   memPeak(MEM_TAG_COUNT) / 1048576.0);
+        }
+
+        // Interleaved Un0/Un_m1 layout against the separate-array kernels
+        double result;
+        memResetPeaks();
+        double rate = benchInterleaved(n, steps, &result);
+        if (result != baseResult)
+        {
+            fprintf(stderr, "interleaved layout disagrees with %s at n=%d\n",
+                    kernelTable[0].name, n);
+            status = 1;
+        }
+        printf("%-6s %6d %-8s %10d %12.1f %9.2fx %10.2f\n", sizes[s].label, n,
+               "interlv", steps, rate * 1e-6, rate / baseRate,
+               memPeak(MEM_TAG_COUNT) / 1048576.0);
+    }
+
+    // Pipelined time stepping on a small grid against the serial step
+    {
+        const int n = 256;
+        const int steps = 400;
+        double** Un_p1 = allocate2DArray(n, n);
+        double** Un0 = allocate2DArray(n, n);
+        double** Un_m1 = allocate2DArray(n, n);
+        initializeArray(Un_p1, n, n);
+        initializeArray(Un0, n, n);
+        initializeArray(Un_m1, n, n);
+
+        EdgeScratch scratch;
+        allocateEdgeScratch(&scratch, n);
+        WaveGrid grid = makeGrid(n, n);
+
+        double start = wallTime();
+        for (int s = 0; s < steps; s++)
+        {
+            stepBand(&grid, Un_p1, Un0, Un_m1, 0, n, s, kernelTable[0].kernel, &scratch);
+            double** temp = Un_m1;
+            Un_m1 = Un0;
+            Un0 = Un_p1;
+            Un_p1 = temp;
+        }
+        double serialRate = (double) n * n * steps / (wallTime() - start);
+
+        printf("\n%-8s %6s %8s %12s %10s\n", "pipeline", "n", "threads", "Mcells/s", "speedup");
+        printf("%-8s %6d %8s %12.1f %9.2fx\n", "", n, "serial", serialRate * 1e-6, 1.0);
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int t = 1; t <= 2 * cpus && t <= PIPELINE_MAX_THREADS; t *= 2)
+        {
+            Pipeline pipe;
+            initPipeline(&pipe, &grid, steps, t, kernelTable[0].kernel, NULL);
+            start = wallTime();
+            runPipeline(&pipe);
+            double rate = (double) n * n * steps / (wallTime() - start);
+
+            double** last = pipelineLevel(&pipe, steps);
+            for (int i = 0; i < n; i++)
+            {
+                if (memcmp(last[i], Un0[i], n * sizeof(double)) != 0)
+                {
+                    fprintf(stderr, "pipeline with %d threads disagrees with serial\n", t);
+                    status = 1;
+                    break;
+                }
+            }
+            printf("%-8s %6d %8d %12.1f %9.2fx\n", "", n, t, rate * 1e-6, rate / serialRate);
+            freePipeline(&pipe);
+        }
+
+        freeEdgeScratch(&scratch);
+        free2DArray(Un_p1, n);
+        free2DArray(Un0, n);
+        free2DArray(Un_m1, n);
+    }
+
+    // Boundary stage on square, tall and wide grids: the cost per edge node
+    // should not depend on the aspect ratio
+    const int shapes[][2] = { { 1024, 1024 }, { 16384, 64 }, { 64, 16384 } };
+    printf("\n%-8s %6s %6s %12s\n", "boundary", "rows", "cols", "ns/node");
+    for (int s = 0; s < (int)(sizeof(shapes) / sizeof(shapes[0])); s++)
+    {
+        printf("%-8s %6d %6d %12.2f\n", "", shapes[s][0], shapes[s][1],
+               benchBoundaries(shapes[s][0], shapes[s][1]));
+    }
+
+    return status;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Time the kernel on an n x n grid at the padded and the unpadded
+ *             row stride, best of CLIFF_REPEATS measurements each
+ * @parameter: kernel: Kernel to time
+ * @parameter: n: Grid size in each direction
+ * @parameter: rates: Filled with the unpadded and padded cell updates per
+ *             second
+ * @return:    N/A
+ *******************************************************************************
+ */
+void measureCliff(InteriorKernel kernel, int n, double rates[2])
+{
+    int steps = (int)(CLIFF_CELL_UPDATES / ((double)n * n));
+    if (steps < BENCH_MIN_STEPS)
+    {
+        steps = BENCH_MIN_STEPS;
+    }
+
+    const int strides[2] = { n, rowStride(n) };
+    for (int v = 0; v < 2; v++)
+    {
+        rates[v] = 0.0;
+        for (int r = 0; r < CLIFF_REPEATS; r++)
+        {
+            double result;
+            double rate = benchKernelStrided(kernel, n, strides[v], steps, &result);
+            rates[v] = rate > rates[v] ? rate : rates[v];
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Scan n x n grids for sizes where the interior update slows down
+ *             sharply. Each size is timed with rows exactly n doubles apart
+ *             and with the stride allocate2DArray pads them to. A size is
+ *             flagged when it is slower than CLIFF_DROP of the median of the
+ *             CLIFF_WINDOW sizes on either side. The cache level that three
+ *             time levels fit in is shown, since crossing one is a step in
+ *             throughput rather than a dip.
+ * @parameter: kernel: Kernel to time
+ * @parameter: from: First grid size
+ * @parameter: to: Last grid size
+ * @parameter: step: Grid size increment
+ * @return:    0 on success
+ *******************************************************************************
+ */
+int runCliffScan(InteriorKernel kernel, int from, int to, int step)
+{
+    const char* name = kernelTable[0].name;
+    for (int k = 0; k < KERNEL_COUNT; k++)
+    {
+        name = kernelTable[k].kernel == kernel ? kernelTable[k].name : name;
+    }
+    const int count = (to - from) / step + 1;
+    int* sizes = (int*) memAlloc(count * sizeof(int), MEM_PROBES);
+    double* rates = (double*) memAlloc(2 * count * sizeof(double), MEM_PROBES);
+    double* medians = (double*) memAlloc(count * sizeof(double), MEM_PROBES);
+
+    // Cache sizes as the C library reports them, 0 where unknown
+    const struct { const char* label; long bytes; } caches[] =
+    {
+        { "L1", sysconf(_SC_LEVEL1_DCACHE_SIZE) },
+        { "L2", sysconf(_SC_LEVEL2_CACHE_SIZE) },
+        { "L3", sysconf(_SC_LEVEL3_CACHE_SIZE) },
+    };
+    printf("Cliff scan of the %s kernel, n x n grids from %d to %d in steps of %d\n", name,
+           from, to, step);
+    printf("caches:");
+    for (int k = 0; k < 3; k++)
+    {
+        if (caches[k].bytes > 0)
+        {
+            printf(" %s %ld KiB", caches[k].label, caches[k].bytes / 1024);
+        }
+    }
+    printf("\n\n%6s %-5s %10s %-*s %7s %10s\n", "n", "fits", "Mcells/s", CLIFF_BAR, "",
+           "stride", "padded");
+
+    double best = 0.0;
+    for (int s = 0; s < count; s++)
+    {
+        sizes[s] = from + s * step;
+        measureCliff(kernel, sizes[s], rates + 2 * s);
+        best = rates[2 * s] > best ? rates[2 * s] : best;
+    }
+
+    int cliffs = 0;
+    for (int s = 0; s < count; s++)
+    {
+        int n = sizes[s];
+
+        // Median of the neighbouring unpadded rates
+        double around[2 * CLIFF_WINDOW];
+        int m = 0;
+        for (int t = s - CLIFF_WINDOW; t <= s + CLIFF_WINDOW; t++)
+        {
+            if (t >= 0 && t < count && t != s)
+            {
+                double rate = rates[2 * t];
+                int k = m++;
+                for (; k > 0 && around[k - 1] > rate; k--)
+                {
+                    around[k] = around[k - 1];
+                }
+                around[k] = rate;
+            }
+        }
+        medians[s] = m == 0 ? rates[2 * s]
+                     : (m % 2 ? around[m / 2] : 0.5 * (around[m / 2 - 1] + around[m / 2]));
+        int cliff = rates[2 * s] < CLIFF_DROP * medians[s];
+        cliffs += cliff;
+
+        double footprint = 3.0 * n * rowStride(n) * sizeof(double);
+        const char* fits = "DRAM";
+        for (int k = 2; k >= 0; k--)
+        {
+            fits = caches[k].bytes > 0 && footprint <= caches[k].bytes ? caches[k].label : fits;
+        }
+
+        char bar[CLIFF_BAR + 1];
+        int length = (int)(CLIFF_BAR * rates[2 * s] / best + 0.5);
+        memset(bar, '#', length);
+        bar[length] = '\0';
+        printf("%6d %-5s %10.1f %-*s %7d %10.1f%s\n", n, fits, rates[2 * s] * 1e-6, CLIFF_BAR,
+               bar, rowStride(n), rates[2 * s + 1] * 1e-6, cliff ? "  cliff" : "");
+    }
+
+    // What the allocator's padding does at each cliff
+    printf("\n%d cliff%s\n", cliffs, cliffs == 1 ? "" : "s");
+    for (int s = 0; s < count; s++)
+    {
+        if (rates[2 * s] < CLIFF_DROP * medians[s])
+        {
+            int n = sizes[s];
+            printf("n = %d: %.2f of its neighbours; allocate2DArray pads rows of %d to %d "
+                   "doubles (+%d B), which runs at %.2f\n", n, rates[2 * s] / medians[s], n,
+                   rowStride(n), (int)((rowStride(n) - n) * sizeof(double)),
+                   rates[2 * s + 1] / medians[s]);
+        }
+    }
+
+    memFree(sizes);
+    memFree(rates);
+    memFree(medians);
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Set up a phase trace
+ * @parameter: trace: Trace to fill
+ * @parameter: capacity: Maximum number of events
+ * @return:    N/A
+ *******************************************************************************
+ */
+void initTrace(PhaseTrace* trace, int capacity)
+{
+    trace->events = (TraceEvent*) memAlloc(capacity * sizeof(TraceEvent), MEM_IO);
+    trace->count = 0;
+    trace->capacity = capacity;
+    trace->origin = wallTime();
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Start timing a phase
+ * @parameter: trace: Trace, or NULL when tracing is off
+ * @return:    Start time to pass to traceEnd
+ *******************************************************************************
+ */
+static inline double traceBegin(const PhaseTrace* trace)
+{
+    return trace != NULL ? wallTime() : 0.0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Record a phase that started at traceBegin's time
+ * @parameter: trace: Trace, or NULL when tracing is off
+ * @parameter: name: Phase name
+ * @parameter: step: Time step index
+ * @parameter: start: Value returned by traceBegin
+ * @return:    N/A
+ *******************************************************************************
+ */
+static inline void traceEnd(PhaseTrace* trace, const char* name, int step, double start)
+{
+    if (trace == NULL || trace->count == trace->capacity)
+    {
+        return;
+    }
+    TraceEvent* event = &trace->events[trace->count++];
+    event->name = name;
+    event->step = step;
+    event->start = start - trace->origin;
+    event->duration = wallTime() - start;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Write a trace in the Chrome trace event format (complete "X"
+ *             events in microseconds), which the Python profiler also writes
+ * @parameter: trace: Trace to write
+ * @parameter: path: Output file
+ * @parameter: grid: Grid constants, stored as metadata
+ * @return:    0 on success, -1 if the file cannot be written
+ *******************************************************************************
+ */
+int writeTrace(const PhaseTrace* trace, const char* path, const WaveGrid* grid)
+{
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(out, "{\"otherData\": {\"backend\": \"c\", \"Nx\": %d, \"Ny\": %d},\n",
+            grid->rows, grid->cols);
+    fprintf(out, " \"displayTimeUnit\": \"ms\",\n \"traceEvents\": [\n");
+    for (int e = 0; e < trace->count; e++)
+    {
+        const TraceEvent* event = &trace->events[e];
+        fprintf(out, "  {\"name\": \"%s\", \"cat\": \"wave\", \"ph\": \"X\", "
+                "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": 0, "
+                "\"args\": {\"step\": %d}}%s\n",
+                event->name, event->start * 1e6, event->duration * 1e6, event->step,
+                e + 1 < trace->count ? "," : "");
+    }
+    fprintf(out, " ]}\n");
+    fclose(out);
+
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free a phase trace
+ * @parameter: trace: Trace to free
+ * @return:    N/A
+ *******************************************************************************
+ */
+void freeTrace(PhaseTrace* trace)
+{
+    memFree(trace->events);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Time step the scheme uses for a grid spacing (the 2D CFL limit,
+ *             as in the dt define)
+ * @parameter: spacingX: Grid size in x direction
+ * @parameter: spacingY: Grid size in y direction
+ * @return:    Time step
+ *******************************************************************************
+ */
+double courantStep(double spacingX, double spacingY)
+{
+    return 1.0 / (c * sqrt((1.0 / (spacingX * spacingX)) + (1.0 / (spacingY * spacingY))));
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Worst relative phase velocity error of the leapfrog scheme over
+ *             all propagation directions, from its numerical dispersion
+ *             relation sin^2(w dt / 2) / (c dt)^2 = sin^2(kx dx / 2) / dx^2
+ *             + sin^2(ky dy / 2) / dy^2
+ * @parameter: spacingX: Grid size in x direction
+ * @parameter: spacingY: Grid size in y direction
+ * @parameter: step: Time step
+ * @parameter: wavelength: Wavelength to resolve
+ * @return:    |v_numerical / c - 1|, INFINITY if the wave is not resolved
+ *******************************************************************************
+ */
+double dispersionError(double spacingX, double spacingY, double step, double wavelength)
+{
+    const double k = 2.0 * M_PI / wavelength;
+    double worst = 0.0;
+
+    for (int a = 0; a <= PLAN_DIRECTIONS; a++)
+    {
+        double theta = 0.5 * M_PI * a / PLAN_DIRECTIONS;
+        double sx = sin(0.5 * k * cos(theta) * spacingX) / spacingX;
+        double sy = sin(0.5 * k * sin(theta) * spacingY) / spacingY;
+        double arg = c * step * sqrt(sx * sx + sy * sy);
+        if (arg > 1.0)
+        {
+            return INFINITY;
+        }
+
+        // Numerical frequency of the wave, compared with the exact c * k
+        double omega = (2.0 / step) * asin(arg);
+        double error = fabs(omega / (c * k) - 1.0);
+        if (error > worst)
+        {
+            worst = error;
+        }
+    }
+
+    return worst;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Phase error accumulated over a number of wavelengths on the
+ *             mesh defines' grid sizes scaled by a factor
+ * @parameter: scale: Factor applied to dx and dy
+ * @parameter: cycles: Propagation distance in wavelengths
+ * @return:    Phase error in radians
+ *******************************************************************************
+ */
+static double planPhase(double scale, double cycles)
+{
+    double step = courantStep(scale * dx, scale * dy);
+    return 2.0 * M_PI * cycles * dispersionError(scale * dx, scale * dy, step, l);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Print one row of the grid plan table
+ * @parameter: label: Row label
+ * @parameter: spacingX: Grid size in x direction
+ * @parameter: spacingY: Grid size in y direction
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @parameter: steps: Time steps to cover the simulated time
+ * @parameter: phaseError: Accumulated phase error in radians
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void printPlanRow(const char* label, double spacingX, double spacingY,
+                         int rows, int cols, long steps, double phaseError)
+{
+    double step = courantStep(spacingX, spacingY);
+    printf("%-8s %7.4f %7.4f %6d %6d %7.3f %7ld %7.1f %9.4f %12.3e\n",
+           label, spacingX * 1e6, spacingY * 1e6, rows, cols, step * 1e15, steps,
+           l / (spacingX > spacingY ? spacingX : spacingY), phaseError,
+           (double)rows * cols * steps);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Pick the coarsest grid whose dispersion keeps the accumulated
+ *             phase error of wavelength l within a budget, and compare its
+ *             cost with the current mesh defines. dx and dy keep their ratio
+ *             and the time step follows the grid, as in the dt define.
+ * @parameter: distance: Propagation distance, 0 for the distance the pulse
+ *             travels in n_stop steps
+ * @parameter: budget: Phase error budget in radians
+ * @return:    0 on success, 1 if no grid meets the budget
+ *******************************************************************************
+ */
+int runGridPlan(double distance, double budget)
+{
+    const double duration = n_stop * dt;
+    if (distance <= 0.0)
+    {
+        distance = c * duration;
+    }
+
+    const double cycles = distance / l;
+
+    // The error grows with the grid size, bisect on the scale between a very
+    // fine grid and two nodes per wavelength
+    double hi = l / (2.0 * (dx > dy ? dx : dy));
+    double lo = hi * 1e-4;
+    if (planPhase(lo, cycles) > budget)
+    {
+        fprintf(stderr, "no grid meets %g rad over %.3f um\n", budget, distance * 1e6);
+        return 1;
+    }
+    if (planPhase(hi, cycles) > budget)
+    {
+        for (int iter = 0; iter < 60; iter++)
+        {
+            double mid = 0.5 * (lo + hi);
+            if (planPhase(mid, cycles) <= budget)
+            {
+                lo = mid;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+    }
+    else
+    {
+        lo = hi;
+    }
+
+    // Whole node counts over the same domain, which can only refine the
+    // spacing found above, and steps covering the same simulated time
+    int rows = (int)ceil(Lx / (lo * dx)) + 1;
+    int cols = (int)ceil(Ly / (lo * dy)) + 1;
+    double planX = Lx / (rows - 1);
+    double planY = Ly / (cols - 1);
+    double planStep = courantStep(planX, planY);
+    long planSteps = (long)ceil(duration / planStep - 1e-9);
+    double plannedPhase = 2.0 * M_PI * cycles * dispersionError(planX, planY, planStep, l);
+    double currentPhase = 2.0 * M_PI * cycles * dispersionError(dx, dy, dt, l);
+
+    printf("Grid plan: wavelength %.3f um over %.3f um (%.1f wavelengths), budget %.4f rad\n\n",
+           l * 1e6, distance * 1e6, cycles, budget);
+    printf("%-8s %7s %7s %6s %6s %7s %7s %7s %9s %12s\n",
+           "grid", "dx um", "dy um", "Nx", "Ny", "dt fs", "steps", "pts/wl",
+           "phase rad", "cell updates");
+    printPlanRow("current", dx, dy, Nx, Ny, n_stop, currentPhase);
+    printPlanRow("planned", planX, planY, rows, cols, planSteps, plannedPhase);
+
+    double ratio = ((double)rows * cols * planSteps) / ((double)Nx * Ny * n_stop);
+    double fieldsMiB = 3.0 * sizeof(double) / (1024.0 * 1024.0);
+    printf("\nThe planned grid needs %.3f times the cell updates (%s %.1fx) and "
+           "%.2f MiB of fields instead of %.2f MiB.\n",
+           ratio, ratio <= 1.0 ? "saves" : "costs", ratio <= 1.0 ? 1.0 / ratio : ratio,
+           fieldsMiB * rows * cols, fieldsMiB * Nx * Ny);
+    if (currentPhase > budget)
+    {
+        printf("The current grid exceeds the budget.\n");
+    }
+
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Complex product without the inf/nan recovery of the C99
+ *             operator, which costs a library call per product
+ * @parameter: a: Factor
+ * @parameter: b: Factor
+ * @return:    a * b
+ *******************************************************************************
+ */
+static inline double complex mulComplex(double complex a, double complex b)
+{
+    return CMPLX(creal(a) * creal(b) - cimag(a) * cimag(b),
+                 creal(a) * cimag(b) + cimag(a) * creal(b));
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Set up the unit cell of a periodic medium with period l
+ * @parameter: cell: Cell to fill
+ * @parameter: rodRadius: Radius of a centered rod of index BLOCH_ROD_INDEX,
+ *             as a fraction of the period, 0 for a homogeneous cell
+ * @return:    N/A
+ *******************************************************************************
+ */
+void initBlochCell(BlochCell* cell, double rodRadius)
+{
+    const int n = BLOCH_CELL_NODES;
+    cell->nodes = n;
+    cell->spacing = l / n;
+    cell->timeStep = BLOCH_COURANT * courantStep(cell->spacing, cell->spacing);
+    cell->steps = (int)ceil(BLOCH_PERIODS * l / (c * cell->timeStep));
+    cell->courant2 = pow(c * cell->timeStep / cell->spacing, 2.0);
+    cell->speed2 = (double*) memAlloc((size_t)n * n * sizeof(double), MEM_FIELDS);
+
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            double x = (i - 0.5 * n) / n;
+            double y = (j - 0.5 * n) / n;
+            int inRod = (x * x + y * y < rodRadius * rodRadius);
+            cell->speed2[i * n + j] = inRod ? 1.0 / (BLOCH_ROD_INDEX * BLOCH_ROD_INDEX) : 1.0;
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free a unit cell
+ * @parameter: cell: Cell to free
+ * @return:    N/A
+ *******************************************************************************
+ */
+void freeBlochCell(BlochCell* cell)
+{
+    memFree(cell->speed2);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     One leapfrog step of the complex field on the unit cell. A
+ *             neighbour across the cell edge is the node on the opposite
+ *             edge times the Bloch phase exp(i k a) in that direction.
+ * @parameter: cell: Unit cell
+ * @parameter: next: Time level n+1
+ * @parameter: now: Time level n
+ * @parameter: prev: Time level n-1
+ * @parameter: phaseX: exp(i kx a)
+ * @parameter: phaseY: exp(i ky a)
+ * @return:    N/A
+ *******************************************************************************
+ */
+void stepBloch(const BlochCell* cell, double complex* next, const double complex* now,
+               const double complex* prev, double complex phaseX, double complex phaseY)
+{
+    const int n = cell->nodes;
+
+    for (int i = 0; i < n; i++)
+    {
+        const double complex* up = now + ((i + n - 1) % n) * n;
+        const double complex* mid = now + i * n;
+        const double complex* down = now + ((i + 1) % n) * n;
+        double complex upPhase = (i == 0) ? conj(phaseX) : 1.0;
+        double complex downPhase = (i == n - 1) ? phaseX : 1.0;
+
+        for (int j = 0; j < n; j++)
+        {
+            double complex left = (j == 0) ? mulComplex(mid[n - 1], conj(phaseY)) : mid[j - 1];
+            double complex right = (j == n - 1) ? mulComplex(mid[0], phaseY) : mid[j + 1];
+            double complex laplacian = mulComplex(upPhase, up[j]) + mulComplex(downPhase, down[j])
+                                       + left + right - 4.0 * mid[j];
+            next[i * n + j] = 2.0 * mid[j] - prev[i * n + j]
+                              + cell->courant2 * cell->speed2[i * n + j] * laplacian;
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Find the bands of one wavevector. A random initial field
+ *             excites every mode, probes record it, and the peaks of the
+ *             windowed probe spectra are the mode frequencies.
+ * @parameter: cell: Unit cell
+ * @parameter: point: Wavevector in, bands out
+ * @parameter: seed: Seed of the initial field and probe positions
+ * @return:    N/A
+ *******************************************************************************
+ */
+void runBlochPoint(const BlochCell* cell, BlochPoint* point, unsigned int seed)
+{
+    const int n = cell->nodes;
+    const int steps = cell->steps;
+    size_t fieldBytes = (size_t)n * n * sizeof(double complex);
+    double complex* next = (double complex*) memAlloc(fieldBytes, MEM_FIELDS);
+    double complex* now = (double complex*) memAlloc(fieldBytes, MEM_FIELDS);
+    double complex* prev = (double complex*) memAlloc(fieldBytes, MEM_FIELDS);
+    double complex* traces = (double complex*) memAlloc((size_t)BLOCH_PROBES * steps
+                                                        * sizeof(double complex), MEM_PROBES);
+    double* power = (double*) memAlloc(BLOCH_FREQ_BINS * sizeof(double), MEM_PROBES);
+
+    // Random field at rest, and random probe nodes
+    for (int k = 0; k < n * n; k++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        double re = (seed >> 8) * (1.0 / 16777216.0) - 0.5;
+        seed = seed * 1664525u + 1013904223u;
+        double im = (seed >> 8) * (1.0 / 16777216.0) - 0.5;
+        now[k] = re + im * I;
+        prev[k] = now[k];
+    }
+    int probes[BLOCH_PROBES];
+    for (int p = 0; p < BLOCH_PROBES; p++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        probes[p] = (int)((seed >> 8) % (unsigned int)(n * n));
+    }
+
+    double complex phaseX = cexp(2.0 * M_PI * point->kx * I);
+    double complex phaseY = cexp(2.0 * M_PI * point->ky * I);
+    for (int t = 0; t < steps; t++)
+    {
+        stepBloch(cell, next, now, prev, phaseX, phaseY);
+        for (int p = 0; p < BLOCH_PROBES; p++)
+        {
+            traces[p * steps + t] = next[probes[p]];
+        }
+        double complex* temp = prev;
+        prev = now;
+        now = next;
+        next = temp;
+    }
+
+    // Blackman windowed spectra summed over the probes, with the mean
+    // removed so the static mode at k = 0 leaves no peak
+    double strongest = 0.0;
+    for (int b = 0; b < BLOCH_FREQ_BINS; b++)
+    {
+        power[b] = 0.0;
+    }
+    for (int p = 0; p < BLOCH_PROBES; p++)
+    {
+        double complex* trace = traces + p * steps;
+        double complex mean = 0.0;
+        for (int t = 0; t < steps; t++)
+        {
+            mean += trace[t];
+        }
+        mean /= steps;
+        for (int t = 0; t < steps; t++)
+        {
+            double x = 2.0 * M_PI * t / (steps - 1);
+            trace[t] = (trace[t] - mean) * (0.42 - 0.5 * cos(x) + 0.08 * cos(2.0 * x));
+        }
+
+        for (int b = 0; b < BLOCH_FREQ_BINS; b++)
+        {
+            double omegaStep = 2.0 * M_PI * BLOCH_MAX_FREQ * (b + 1) / BLOCH_FREQ_BINS
+                               * c * cell->timeStep / l;
+            double complex rotate = cexp(-omegaStep * I);
+            double complex phasor = 1.0;
+            double complex sum = 0.0;
+            for (int t = 0; t < steps; t++)
+            {
+                sum += mulComplex(trace[t], phasor);
+                phasor = mulComplex(phasor, rotate);
+            }
+            power[b] += creal(sum) * creal(sum) + cimag(sum) * cimag(sum);
+        }
+    }
+    for (int b = 0; b < BLOCH_FREQ_BINS; b++)
+    {
+        strongest = power[b] > strongest ? power[b] : strongest;
+    }
+
+    // Local maxima above the noise floor, refined by a parabola through the
+    // log power of the peak bin and its neighbours
+    point->bandCount = 0;
+    for (int b = 2; b < BLOCH_FREQ_BINS - 2 && point->bandCount < BLOCH_BANDS; b++)
+    {
+        if (power[b] < BLOCH_PEAK_FLOOR * strongest || power[b] <= power[b - 1]
+            || power[b] <= power[b - 2] || power[b] < power[b + 1] || power[b] < power[b + 2])
+        {
+            continue;
+        }
+        double lower = log(power[b - 1]);
+        double centre = log(power[b]);
+        double upper = log(power[b + 1]);
+        double denominator = lower - 2.0 * centre + upper;
+        double offset = denominator != 0.0 ? 0.5 * (lower - upper) / denominator : 0.0;
+        point->bands[point->bandCount++] = BLOCH_MAX_FREQ * (b + 1 + offset) / BLOCH_FREQ_BINS;
+    }
+
+    memFree(next);
+    memFree(now);
+    memFree(prev);
+    memFree(traces);
+    memFree(power);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Sweep thread, takes k-points from the batch until none are left
+ * @parameter: arg: BlochBatch
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* blochWorker(void* arg)
+{
+    BlochBatch* batch = (BlochBatch*) arg;
+
+    for (;;)
+    {
+        int k = atomic_fetch_add(&batch->next, 1);
+        if (k >= batch->count)
+        {
+            return NULL;
+        }
+        runBlochPoint(batch->cell, &batch->points[k], 12345u + 7919u * (unsigned int)k);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Band structure of a periodic medium along G-X-M-G, one unit
+ *             cell per k-point, with the k-points run as a batch on all cores
+ * @parameter: perSegment: k-points per segment of the path
+ * @parameter: rodRadius: Rod radius as a fraction of the period
+ * @return:    0
+ *******************************************************************************
+ */
+int runBlochSweep(int perSegment, double rodRadius)
+{
+    // Corners of the irreducible Brillouin zone in units of 2 pi / a
+    const double corners[4][2] = { { 0.0, 0.0 }, { 0.5, 0.0 }, { 0.5, 0.5 }, { 0.0, 0.0 } };
+    const char* const cornerNames[4] = { "G", "X", "M", "G" };
+
+    BlochCell cell;
+    initBlochCell(&cell, rodRadius);
+
+    int count = 3 * perSegment + 1;
+    BlochPoint* points = (BlochPoint*) memAlloc(count * sizeof(BlochPoint), MEM_RUNTIME);
+    for (int k = 0; k < count; k++)
+    {
+        int segment = k / perSegment < 3 ? k / perSegment : 2;
+        double f = (double)(k - segment * perSegment) / perSegment;
+        points[k].kx = corners[segment][0] + f * (corners[segment + 1][0] - corners[segment][0]);
+        points[k].ky = corners[segment][1] + f * (corners[segment + 1][1] - corners[segment][1]);
+        points[k].bandCount = 0;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = (int)(cpus < count ? cpus : count);
+    threadCount = threadCount < 1 ? 1 : threadCount;
+    pthread_t* threads = (pthread_t*) memAlloc(threadCount * sizeof(pthread_t), MEM_RUNTIME);
+    BlochBatch batch = { &cell, points, count, 0 };
+
+    double start = wallTime();
+    for (int t = 0; t < threadCount; t++)
+    {
+        pthread_create(&threads[t], NULL, blochWorker, &batch);
+    }
+    for (int t = 0; t < threadCount; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = wallTime() - start;
+
+    printf("Bloch sweep: %d x %d cell, %d steps, rod radius %.2f a, %d k-points on %d threads, %.2f s\n\n",
+           cell.nodes, cell.nodes, cell.steps, rodRadius, count, threadCount, elapsed);
+    printf("%-6s %9s %9s   %s\n", "point", "kx a/2pi", "ky a/2pi", "bands f a / c");
+    for (int k = 0; k < count; k++)
+    {
+        const char* name = (k % perSegment == 0) ? cornerNames[k / perSegment] : "";
+        printf("%-6s %9.4f %9.4f  ", name, points[k].kx, points[k].ky);
+        for (int b = 0; b < points[k].bandCount; b++)
+        {
+            printf(" %7.4f", points[k].bands[b]);
+        }
+        printf("\n");
+    }
+
+    memFree(threads);
+    memFree(points);
+    freeBlochCell(&cell);
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Read a list of grid nodes, one "row col" pair per line. Lines
+ *             starting with # are comments.
+ * @parameter: path: File to read
+ * @parameter: grid: Grid the nodes must lie inside of
+ * @parameter: nodes: Set to the allocated list
+ * @parameter: count: Set to the number of nodes
+ * @return:    0 on success, -1 on a missing file or bad node
+ *******************************************************************************
+ */
+int readNodeList(const char* path, const WaveGrid* grid, GridNode** nodes, int* count)
+{
+    FILE* in = fopen(path, "r");
+    if (in == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    int capacity = 64;
+    *nodes = (GridNode*) memAlloc(capacity * sizeof(GridNode), MEM_RUNTIME);
+    *count = 0;
+
+    char line[256];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        lineNumber++;
+        GridNode node;
+        char extra;
+        if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+        {
+            continue;
+        }
+        if (sscanf(line, "%d %d %c", &node.row, &node.col, &extra) != 2
+            || node.row < 1 || node.row > grid->rows - 2
+            || node.col < 1 || node.col > grid->cols - 2)
+        {
+            fprintf(stderr, "%s:%d: need an interior \"row col\" pair\n", path, lineNumber);
+            fclose(in);
+            memFree(*nodes);
+            return -1;
+        }
+
+        if (*count == capacity)
+        {
+            GridNode* grown = (GridNode*) memAlloc(2 * capacity * sizeof(GridNode), MEM_RUNTIME);
+            memcpy(grown, *nodes, capacity * sizeof(GridNode));
+            memFree(*nodes);
+            *nodes = grown;
+            capacity *= 2;
+        }
+        (*nodes)[(*count)++] = node;
+    }
+    fclose(in);
+
+    if (*count == 0)
+    {
+        fprintf(stderr, "%s: no nodes\n", path);
+        memFree(*nodes);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     One run of a survey: add the source pulse at one or more nodes
+ *             and record the field at a list of nodes every step
+ * @parameter: grid: Grid constants
+ * @parameter: kernel: Interior update kernel
+ * @parameter: inject: Nodes the pulse is added at
+ * @parameter: weights: Pulse amplitude per injection node, NULL for all 1
+ * @parameter: delays: Pulse delay in steps per injection node, NULL for none
+ * @parameter: injectCount: Number of injection nodes
+ * @parameter: record: Nodes to record
+ * @parameter: recordCount: Number of nodes to record
+ * @parameter: steps: Time steps
+ * @parameter: out: recordCount traces of steps samples each
+ * @return:    N/A
+ *******************************************************************************
+ */
+void runShot(const WaveGrid* grid, InteriorKernel kernel, const GridNode* inject,
+             const double* weights, const int* delays, int injectCount,
+             const GridNode* record, int recordCount, int steps, double* out)
+{
+    const int rows = grid->rows;
+    const int cols = grid->cols;
+    double** Un_p1 = allocate2DArray(rows, cols);
+    double** Un0 = allocate2DArray(rows, cols);
+    double** Un_m1 = allocate2DArray(rows, cols);
+    initializeArray(Un_p1, rows, cols);
+    initializeArray(Un0, rows, cols);
+    initializeArray(Un_m1, rows, cols);
+
+    EdgeScratch scratch;
+    allocateEdgeScratch(&scratch, rows > cols ? rows : cols);
+
+    for (int n = 0; n < steps; n++)
+    {
+        FieldRef next = { Un_p1, 1, 0 };
+        FieldRef now = { Un0, 1, 0 };
+
+        // A soft source is added to the field instead of overwriting it, so
+        // swapping source and receiver gives the same trace
+        kernel(Un_p1, Un0, Un_m1, rows, cols, grid->ox2, grid->oy2);
+        for (int k = 0; k < injectCount; k++)
+        {
+            int delay = delays != NULL ? delays[k] : 0;
+            if (n >= delay)
+            {
+                double weight = weights != NULL ? weights[k] : 1.0;
+                Un_p1[inject[k].row][inject[k].col] += weight * sourceValue((n - delay) * grid->timeStep);
+            }
+        }
+        applyBoundaries(next, now, grid, &scratch);
+
+        for (int r = 0; r < recordCount; r++)
+        {
+            out[(size_t)r * steps + n] = Un_p1[record[r].row][record[r].col];
+        }
+
+        double** temp = Un_m1;
+        Un_m1 = Un0;
+        Un0 = Un_p1;
+        Un_p1 = temp;
+    }
+
+    free2DArray(Un_p1, rows);
+    free2DArray(Un0, rows);
+    free2DArray(Un_m1, rows);
+    freeEdgeScratch(&scratch);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Survey thread, takes shots until none are left and files each
+ *             trace under its (source, receiver) pair
+ * @parameter: arg: SurveyBatch
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* surveyWorker(void* arg)
+{
+    SurveyBatch* batch = (SurveyBatch*) arg;
+    const Survey* survey = batch->survey;
+    const int steps = survey->steps;
+
+    // A direct shot fires a source and records the receivers, a reciprocal
+    // shot fires a receiver and records the sources
+    const GridNode* fire = batch->reciprocal ? survey->receivers : survey->sources;
+    int fireCount = batch->reciprocal ? survey->receiverCount : survey->sourceCount;
+    const GridNode* record = batch->reciprocal ? survey->sources : survey->receivers;
+    int recordCount = batch->reciprocal ? survey->sourceCount : survey->receiverCount;
+
+    double* shot = (double*) memAlloc((size_t)recordCount * steps * sizeof(double), MEM_PROBES);
+    for (;;)
+    {
+        int k = atomic_fetch_add(&batch->next, 1);
+        if (k >= fireCount)
+        {
+            break;
+        }
+        runShot(batch->grid, batch->kernel, &fire[k], NULL, NULL, 1, record, recordCount,
+                steps, shot);
+
+        for (int r = 0; r < recordCount; r++)
+        {
+            int source = batch->reciprocal ? r : k;
+            int receiver = batch->reciprocal ? k : r;
+            memcpy(batch->traces + ((size_t)source * survey->receiverCount + receiver) * steps,
+                   shot + (size_t)r * steps, steps * sizeof(double));
+        }
+    }
+    memFree(shot);
+
+    return NULL;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Run every shot of a survey on all cores
+ * @parameter: survey: Survey, its traces are filled
+ * @parameter: grid: Grid constants
+ * @parameter: kernel: Interior update kernel
+ * @parameter: reciprocal: Fire the receivers instead of the sources
+ * @parameter: traces: [source][receiver][step] output
+ * @return:    Wall time in seconds
+ *******************************************************************************
+ */
+double runSurveyShots(const Survey* survey, const WaveGrid* grid, InteriorKernel kernel,
+                      int reciprocal, double* traces)
+{
+    int shots = reciprocal ? survey->receiverCount : survey->sourceCount;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = (int)(cpus < shots ? cpus : shots);
+    threadCount = threadCount < 1 ? 1 : threadCount;
+
+    pthread_t* threads = (pthread_t*) memAlloc(threadCount * sizeof(pthread_t), MEM_RUNTIME);
+    SurveyBatch batch = { survey, grid, kernel, reciprocal, traces, 0 };
+
+    double start = wallTime();
+    for (int t = 0; t < threadCount; t++)
+    {
+        pthread_create(&threads[t], NULL, surveyWorker, &batch);
+    }
+    for (int t = 0; t < threadCount; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = wallTime() - start;
+
+    memFree(threads);
+    return elapsed;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Encoded survey thread, takes supershots until none are left
+ * @parameter: arg: EncodedBatch
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* encodedWorker(void* arg)
+{
+    EncodedBatch* batch = (EncodedBatch*) arg;
+    const Survey* survey = batch->survey;
+    const int sources = survey->sourceCount;
+
+    for (;;)
+    {
+        int m = atomic_fetch_add(&batch->next, 1);
+        if (m >= batch->runs)
+        {
+            return NULL;
+        }
+        runShot(batch->grid, batch->kernel, survey->sources, batch->weights + (size_t)m * sources,
+                batch->delays + (size_t)m * sources, sources, survey->receivers,
+                survey->receiverCount, batch->steps,
+                batch->records + (size_t)m * survey->receiverCount * batch->steps);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Fire every source at once in each of a few runs, each source
+ *             with a random polarity, and optionally a random delay, per run,
+ *             then deblend. Undoing a source's code and averaging over the
+ *             runs keeps its own trace, while the other sources add up with
+ *             random signs: the crosstalk left shrinks as one over the square
+ *             root of the runs. Delays alone would leave crosstalk with a
+ *             nonzero mean, so they always come with random signs.
+ * @parameter: survey: Survey, its traces are filled with the decoded traces
+ * @parameter: grid: Grid constants
+ * @parameter: kernel: Interior update kernel
+ * @parameter: encoding: Polarity or delay codes
+ * @parameter: runs: Encoded runs
+ * @return:    Wall time in seconds
+ *******************************************************************************
+ */
+double runEncodedShots(const Survey* survey, const WaveGrid* grid, InteriorKernel kernel,
+                       SurveyEncoding encoding, int runs)
+{
+    const int sources = survey->sourceCount;
+    const int receivers = survey->receiverCount;
+    const int steps = survey->steps;
+
+    // Delayed sources run longer so the last delayed pulse is still recorded
+    // for the full survey length
+    int maxDelay = (encoding == ENCODE_DELAY) ? SURVEY_MAX_DELAY : 0;
+    int recordSteps = steps + maxDelay;
+
+    double* weights = (double*) memAlloc((size_t)runs * sources * sizeof(double), MEM_RUNTIME);
+    int* delays = (int*) memAlloc((size_t)runs * sources * sizeof(int), MEM_RUNTIME);
+    double* records = (double*) memAlloc((size_t)runs * receivers * recordSteps * sizeof(double),
+                                         MEM_PROBES);
+
+    unsigned int seed = SURVEY_ENCODE_SEED;
+    for (size_t k = 0; k < (size_t)runs * sources; k++)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        weights[k] = (seed >> 31) ? -1.0 : 1.0;
+        delays[k] = (encoding == ENCODE_DELAY) ? (int)((seed >> 8) % (unsigned int)(maxDelay + 1)) : 0;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threadCount = (int)(cpus < runs ? cpus : runs);
+    threadCount = threadCount < 1 ? 1 : threadCount;
+    pthread_t* threads = (pthread_t*) memAlloc(threadCount * sizeof(pthread_t), MEM_RUNTIME);
+    EncodedBatch batch = { survey, grid, kernel, weights, delays, runs, recordSteps, records, 0 };
+
+    double start = wallTime();
+    for (int t = 0; t < threadCount; t++)
+    {
+        pthread_create(&threads[t], NULL, encodedWorker, &batch);
+    }
+    for (int t = 0; t < threadCount; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Deblend: shift each run back by the source's delay, undo its
+    // polarity and average over the runs
+    for (int s = 0; s < sources; s++)
+    {
+        for (int r = 0; r < receivers; r++)
+        {
+            double* trace = survey->traces + ((size_t)s * receivers + r) * steps;
+            for (int n = 0; n < steps; n++)
+            {
+                trace[n] = 0.0;
+            }
+            for (int m = 0; m < runs; m++)
+            {
+                const double* record = records + ((size_t)m * receivers + r) * recordSteps
+                                       + delays[(size_t)m * sources + s];
+                double weight = weights[(size_t)m * sources + s] / runs;
+                for (int n = 0; n < steps; n++)
+                {
+                    trace[n] += weight * record[n];
+                }
+            }
+        }
+    }
+    double elapsed = wallTime() - start;
+
+    memFree(threads);
+    memFree(records);
+    memFree(delays);
+    memFree(weights);
+    return elapsed;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Write survey traces, one line per (source, receiver) pair in
+ *             the order of the source list
+ * @parameter: survey: Survey with traces
+ * @parameter: path: Output file
+ * @return:    0 on success, -1 if the file cannot be written
+ *******************************************************************************
+ */
+int writeSurvey(const Survey* survey, const char* path)
+{
+    FILE* out = fopen(path, "w");
+    if (out == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(out, "# source src_row src_col receiver rec_row rec_col, then %d samples\n",
+            survey->steps);
+    for (int s = 0; s < survey->sourceCount; s++)
+    {
+        for (int r = 0; r < survey->receiverCount; r++)
+        {
+            const double* trace = survey->traces
+                                  + ((size_t)s * survey->receiverCount + r) * survey->steps;
+            fprintf(out, "%d %d %d %d %d %d", s, survey->sources[s].row, survey->sources[s].col,
+                    r, survey->receivers[r].row, survey->receivers[r].col);
+            for (int n = 0; n < survey->steps; n++)
+            {
+                fprintf(out, " %.17g", trace[n]);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    fclose(out);
+
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Record the trace of every source at every receiver. Reciprocity
+ *             of the wave equation lets a survey with fewer receivers than
+ *             sources fire the receivers and record at the sources instead.
+ * @parameter: grid: Grid constants
+ * @parameter: options: Command line options
+ * @return:    0 on success, 1 on bad input
+ *******************************************************************************
+ */
+int runSurvey(const WaveGrid* grid, const SimOptions* options)
+{
+    Survey survey;
+    survey.steps = n_stop;
+
+    // Default receiver at the usual source node and sources every
+    // SURVEY_SOURCE_SPACING nodes over the interior
+    if (options->receiverPath != NULL)
+    {
+        if (readNodeList(options->receiverPath, grid, &survey.receivers,
+                         &survey.receiverCount) != 0)
+        {
+            return 1;
+        }
+    }
+    else
+    {
+        survey.receivers = (GridNode*) memAlloc(sizeof(GridNode), MEM_RUNTIME);
+        survey.receivers[0] = (GridNode){ grid->srcRow, grid->srcCol };
+        survey.receiverCount = 1;
+    }
+    if (options->sourcePath != NULL)
+    {
+        if (readNodeList(options->sourcePath, grid, &survey.sources, &survey.sourceCount) != 0)
+        {
+            memFree(survey.receivers);
+            return 1;
+        }
+    }
+    else
+    {
+        int perRow = (grid->cols - 2 + SURVEY_SOURCE_SPACING - 1) / SURVEY_SOURCE_SPACING;
+        int perCol = (grid->rows - 2 + SURVEY_SOURCE_SPACING - 1) / SURVEY_SOURCE_SPACING;
+        survey.sourceCount = perRow * perCol;
+        survey.sources = (GridNode*) memAlloc(survey.sourceCount * sizeof(GridNode), MEM_RUNTIME);
+        for (int k = 0; k < survey.sourceCount; k++)
+        {
+            survey.sources[k].row = 1 + (k / perRow) * SURVEY_SOURCE_SPACING;
+            survey.sources[k].col = 1 + (k % perRow) * SURVEY_SOURCE_SPACING;
+        }
+    }
+
+    size_t traceCount = (size_t)survey.sourceCount * survey.receiverCount * survey.steps;
+    survey.traces = (double*) memAlloc(traceCount * sizeof(double), MEM_PROBES);
+
+    int shorter = survey.receiverCount < survey.sourceCount;
+    int reciprocal = (options->surveyMode == SURVEY_RECIPROCAL)
+                     || ((options->surveyMode == SURVEY_AUTO || options->surveyMode == SURVEY_CHECK)
+                         && shorter);
+    // Encoded runs only pay off when they are fewer than the exact runs
+    // the cheaper way, and their crosstalk falls only as 1 / sqrt(M)
+    SurveyEncoding encoding = options->encoding;
+    int exactRuns = shorter ? survey.receiverCount : survey.sourceCount;
+    if (encoding != ENCODE_NONE)
+    {
+        printf("Encoded: %d runs, expected rms crosstalk %.2f of the signal; exact %s runs "
+               "need %d\n", options->encodeRuns,
+               sqrt((survey.sourceCount - 1.0) / options->encodeRuns),
+               shorter ? "reciprocal" : "direct", exactRuns);
+        if (options->encodeRuns >= exactRuns)
+        {
+            fprintf(stderr, "warning: --encode-runs=%d is not fewer than the %d exact runs, "
+                    "running those instead\n", options->encodeRuns, exactRuns);
+            encoding = ENCODE_NONE;
+            reciprocal = shorter;
+        }
+    }
+
+    double elapsed;
+    if (encoding != ENCODE_NONE)
+    {
+        elapsed = runEncodedShots(&survey, grid, options->kernel, encoding,
+                                  options->encodeRuns);
+        printf("Survey: %d sources, %d receivers, %s-encoded runs: %d runs of %d steps in %.2f s\n",
+               survey.sourceCount, survey.receiverCount,
+               encoding == ENCODE_POLARITY ? "polarity" : "delay",
+               options->encodeRuns, survey.steps, elapsed);
+    }
+    else
+    {
+        elapsed = runSurveyShots(&survey, grid, options->kernel, reciprocal, survey.traces);
+        printf("Survey: %d sources, %d receivers, %s runs: %d runs of %d steps in %.2f s\n",
+               survey.sourceCount, survey.receiverCount, reciprocal ? "reciprocal" : "direct",
+               reciprocal ? survey.receiverCount : survey.sourceCount, survey.steps, elapsed);
+    }
+
+    // Run the other way, or exactly in the cheaper way after encoded runs,
+    // and compare
+    if (options->surveyMode == SURVEY_CHECK)
+    {
+        int otherWay = (encoding != ENCODE_NONE) ? shorter : !reciprocal;
+        double* exact = (double*) memAlloc(traceCount * sizeof(double), MEM_PROBES);
+        double exactTime = runSurveyShots(&survey, grid, options->kernel, otherWay, exact);
+        double largest = 0.0;
+        double difference = 0.0;
+        double signal = 0.0;
+        double error = 0.0;
+        for (size_t k = 0; k < traceCount; k++)
+        {
+            double d = fabs(exact[k] - survey.traces[k]);
+            largest = fabs(exact[k]) > largest ? fabs(exact[k]) : largest;
+            difference = d > difference ? d : difference;
+            signal += exact[k] * exact[k];
+            error += d * d;
+        }
+        printf("Check:  %s runs took %.2f s, largest difference %.3e and rms difference %.3e "
+               "relative to the exact traces\n",
+               otherWay ? "reciprocal" : "direct", exactTime,
+               largest > 0.0 ? difference / largest : 0.0,
+               signal > 0.0 ? sqrt(error / signal) : 0.0);
+        memFree(exact);
+    }
+
+    int status = 0;
+    if (options->surveyPath != NULL)
+    {
+        status = writeSurvey(&survey, options->surveyPath) != 0;
+    }
+
+    memFree(survey.traces);
+    memFree(survey.sources);
+    memFree(survey.receivers);
+    return status;
+}
+
+// Stands in for every tile that has only ever held zeros. Never written.
+static double zeroTile[FIELD_TILE * FIELD_TILE];
+
+/**
+ *******************************************************************************
+ * @brief:     Whether a value is +0.0. Anything else, -0.0 included, needs a
+ *             tile of its own for the tiled run to match the dense one bit
+ *             for bit.
+ * @parameter: value: Value to test
+ * @return:    1 for +0.0
+ *******************************************************************************
+ */
+static inline int isPositiveZero(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits == 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Start a tiled time level with every tile the shared zero tile
+ * @parameter: field: Field to fill
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @parameter: count: Tile counters, shared with the other levels of the run
+ * @return:    N/A
+ *******************************************************************************
+ */
+void initTiledField(TiledField* field, int rows, int cols, TileCount* count)
+{
+    field->rows = rows;
+    field->cols = cols;
+    field->tileRows = (rows + FIELD_TILE - 1) / FIELD_TILE;
+    field->tileCols = (cols + FIELD_TILE - 1) / FIELD_TILE;
+    field->count = count;
+
+    int tiles = field->tileRows * field->tileCols;
+    field->tiles = (double**) memAlloc(tiles * sizeof(double*), MEM_FIELDS);
+    for (int t = 0; t < tiles; t++)
+    {
+        field->tiles[t] = zeroTile;
+    }
+    count->total += tiles;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free a tiled time level
+ * @parameter: field: Field to free
+ * @return:    N/A
+ *******************************************************************************
+ */
+void freeTiledField(TiledField* field)
+{
+    for (int t = 0; t < field->tileRows * field->tileCols; t++)
+    {
+        if (field->tiles[t] != zeroTile)
+        {
+            memFree(field->tiles[t]);
+        }
+    }
+    memFree(field->tiles);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Give a tile storage of its own, zero filled
+ * @parameter: field: Tiled time level
+ * @parameter: t: Tile index, row major
+ * @return:    The tile
+ *******************************************************************************
+ */
+static double* allocateTile(TiledField* field, int t)
+{
+    field->tiles[t] = (double*) memAlloc(FIELD_TILE * FIELD_TILE * sizeof(double), MEM_FIELDS);
+    memset(field->tiles[t], 0, FIELD_TILE * FIELD_TILE * sizeof(double));
+    if (++field->count->live > field->count->peak)
+    {
+        field->count->peak = field->count->live;
+    }
+    return field->tiles[t];
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Hand a tile back to the shared zero tile
+ * @parameter: field: Tiled time level
+ * @parameter: t: Tile index, row major
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void releaseTile(TiledField* field, int t)
+{
+    memFree(field->tiles[t]);
+    field->tiles[t] = zeroTile;
+    field->count->live--;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Read a node of a tiled time level
+ * @parameter: field: Tiled time level
+ * @parameter: ii: Row index
+ * @parameter: jj: Column index
+ * @return:    Node value
+ *******************************************************************************
+ */
+static inline double tiledGet(const TiledField* field, int ii, int jj)
+{
+    return field->tiles[(ii / FIELD_TILE) * field->tileCols + jj / FIELD_TILE]
+                       [(ii % FIELD_TILE) * FIELD_TILE + jj % FIELD_TILE];
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Write a node of a tiled time level. The first value other than
+ *             +0.0 written into a zero tile allocates it.
+ * @parameter: field: Tiled time level
+ * @parameter: ii: Row index
+ * @parameter: jj: Column index
+ * @parameter: value: Node value
+ * @return:    N/A
+ *******************************************************************************
+ */
+static inline void tiledSet(TiledField* field, int ii, int jj, double value)
+{
+    int t = (ii / FIELD_TILE) * field->tileCols + jj / FIELD_TILE;
+    double* tile = field->tiles[t];
+    if (tile == zeroTile)
+    {
+        if (isPositiveZero(value))
+        {
+            return;
+        }
+        tile = allocateTile(field, t);
+    }
+    tile[(ii % FIELD_TILE) * FIELD_TILE + jj % FIELD_TILE] = value;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Interior update of a tiled time level, tile by tile. Tiles
+ *             whose stencil only reads zero tiles stay zero without being
+ *             computed. The others are computed with the scalar kernel's
+ *             expression into a scratch tile, and only get storage when a
+ *             value in them is not +0.0.
+ * @parameter: next: Time level n+1 (output)
+ * @parameter: now: Time level n
+ * @parameter: prev: Time level n-1
+ * @parameter: ox2: Squared Courant number in x
+ * @parameter: oy2: Squared Courant number in y
+ * @return:    N/A
+ *******************************************************************************
+ */
+void updateInteriorTiled(TiledField* next, const TiledField* now, const TiledField* prev,
+                         double ox2, double oy2)
+{
+    const int rows = now->rows;
+    const int cols = now->cols;
+    const int span = FIELD_TILE + 2;
+    double halo[(FIELD_TILE + 2) * (FIELD_TILE + 2)];
+    double out[FIELD_TILE * FIELD_TILE];
+
+    for (int ti = 0; ti < now->tileRows; ti++)
+    {
+        for (int tj = 0; tj < now->tileCols; tj++)
+        {
+            int t = ti * now->tileCols + tj;
+            const double* centre = now->tiles[t];
+
+            // The 5-point stencil reaches into the four side neighbours only
+            int quiet = centre == zeroTile && prev->tiles[t] == zeroTile
+                        && (ti == 0 || now->tiles[t - now->tileCols] == zeroTile)
+                        && (ti == now->tileRows - 1 || now->tiles[t + now->tileCols] == zeroTile)
+                        && (tj == 0 || now->tiles[t - 1] == zeroTile)
+                        && (tj == now->tileCols - 1 || now->tiles[t + 1] == zeroTile);
+            if (quiet)
+            {
+                if (next->tiles[t] != zeroTile)
+                {
+                    releaseTile(next, t);
+                }
+                continue;
+            }
+
+            // Time level n with a one node halo from the neighbouring tiles
+            int i0 = ti * FIELD_TILE;
+            int j0 = tj * FIELD_TILE;
+            int height = i0 + FIELD_TILE < rows ? FIELD_TILE : rows - i0;
+            int width = j0 + FIELD_TILE < cols ? FIELD_TILE : cols - j0;
+            for (int r = 0; r < height; r++)
+            {
+                memcpy(&halo[(r + 1) * span + 1], &centre[r * FIELD_TILE], width * sizeof(double));
+                halo[(r + 1) * span] = j0 > 0 ? tiledGet(now, i0 + r, j0 - 1) : 0.0;
+                halo[(r + 1) * span + width + 1] = j0 + width < cols
+                                                   ? tiledGet(now, i0 + r, j0 + width) : 0.0;
+            }
+            for (int k = 0; k < width; k++)
+            {
+                halo[1 + k] = i0 > 0 ? tiledGet(now, i0 - 1, j0 + k) : 0.0;
+                halo[(height + 1) * span + 1 + k] = i0 + height < rows
+                                                    ? tiledGet(now, i0 + height, j0 + k) : 0.0;
+            }
+
+            // Edge nodes are left at zero here, the boundary update sets them
+            const double* older = prev->tiles[t];
+            int nonzero = 0;
+            memset(out, 0, sizeof(out));
+            for (int r = 0; r < height; r++)
+            {
+                int ii = i0 + r;
+                if (ii < 1 || ii >= rows - 1)
+                {
+                    continue;
+                }
+                const double* U = &halo[(r + 1) * span + 1];
+                for (int k = 0; k < width; k++)
+                {
+                    int jj = j0 + k;
+                    if (jj < 1 || jj >= cols - 1)
+                    {
+                        continue;
+                    }
+                    double value = 2 * U[k]
+                        + ox2 * (U[k + span] - 2 * U[k] + U[k - span])
+                        + oy2 * (U[k + 1] - 2 * U[k] + U[k - 1])
+                        - older[r * FIELD_TILE + k];
+                    out[r * FIELD_TILE + k] = value;
+                    nonzero |= !isPositiveZero(value);
+                }
+            }
+
+            if (nonzero)
+            {
+                double* tile = next->tiles[t] == zeroTile ? allocateTile(next, t) : next->tiles[t];
+                memcpy(tile, out, sizeof(out));
+            }
+            else if (next->tiles[t] != zeroTile)
+            {
+                releaseTile(next, t);
+            }
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Radiating boundary conditions and corner averages of a tiled
+ *             time level, node by node with the dense version's expressions
+ * @parameter: next: Time level n+1, interior already updated
+ * @parameter: now: Time level n
+ * @parameter: grid: Grid constants
+ * @return:    N/A
+ *******************************************************************************
+ */
+void applyTiledBoundaries(TiledField* next, const TiledField* now, const WaveGrid* grid)
+{
+    const int rows = grid->rows;
+    const int cols = grid->cols;
+    const double coefX = grid->coefX;
+    const double coefY = grid->coefY;
+
+    for (int jj = 1; jj < cols - 1; jj++)
+    {
+        tiledSet(next, 0, jj, tiledGet(now, 1, jj)
+                 + (coefX * (tiledGet(next, 1, jj) - tiledGet(now, 0, jj))));
+        tiledSet(next, rows - 1, jj, tiledGet(now, rows - 2, jj)
+                 + (coefX * (tiledGet(next, rows - 2, jj) - tiledGet(now, rows - 1, jj))));
+    }
+    for (int ii = 1; ii < rows - 1; ii++)
+    {
+        tiledSet(next, ii, 0, tiledGet(now, ii, 1)
+                 + (coefY * (tiledGet(next, ii, 1) - tiledGet(now, ii, 0))));
+        tiledSet(next, ii, cols - 1, tiledGet(now, ii, cols - 2)
+                 + (coefY * (tiledGet(next, ii, cols - 2) - tiledGet(now, ii, cols - 1))));
+    }
+
+    tiledSet(next, 0, 0, 0.5 * (tiledGet(next, 1, 0) + tiledGet(next, 0, 1)));
+    tiledSet(next, rows - 1, 0, 0.5 * (tiledGet(next, rows - 2, 0) + tiledGet(next, rows - 1, 1)));
+    tiledSet(next, rows - 1, cols - 1, 0.5 * (tiledGet(next, rows - 2, cols - 1)
+                                              + tiledGet(next, rows - 1, cols - 2)));
+    tiledSet(next, 0, cols - 1, 0.5 * (tiledGet(next, 0, cols - 2) + tiledGet(next, 1, cols - 1)));
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Copy a tiled time level into a dense view for the frame outputs
+ * @parameter: view: Dense rows, rows x cols
+ * @parameter: field: Tiled time level
+ * @return:    N/A
+ *******************************************************************************
+ */
+void copyTiledToView(double** view, const TiledField* field)
+{
+    for (int ti = 0; ti < field->tileRows; ti++)
+    {
+        for (int tj = 0; tj < field->tileCols; tj++)
+        {
+            const double* tile = field->tiles[ti * field->tileCols + tj];
+            int i0 = ti * FIELD_TILE;
+            int j0 = tj * FIELD_TILE;
+            int height = i0 + FIELD_TILE < field->rows ? FIELD_TILE : field->rows - i0;
+            int width = j0 + FIELD_TILE < field->cols ? FIELD_TILE : field->cols - j0;
+            for (int r = 0; r < height; r++)
+            {
+                memcpy(&view[i0 + r][j0], &tile[r * FIELD_TILE], width * sizeof(double));
+            }
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Dense view of a time level for frame outputs, one block with row
+ *             pointers, accounted to io rather than to the fields
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @return:    Row pointers, free with freeView
+ *******************************************************************************
+ */
+static double** allocateView(int rows, int cols)
+{
+    double** view = (double**) memAlloc(rows * sizeof(double*), MEM_IO);
+    view[0] = (double*) memAlloc((size_t) rows * cols * sizeof(double), MEM_IO);
+    for (int i = 1; i < rows; i++)
+    {
+        view[i] = view[0] + (size_t) i * cols;
+    }
+    return view;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free a dense view
+ * @parameter: view: View from allocateView, or NULL
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void freeView(double** view)
+{
+    if (view != NULL)
+    {
+        memFree(view[0]);
+        memFree(view);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Serial time marching on tiled time levels, whose tiles are only
+ *             allocated once the wave reaches them. Frames go through a dense
+ *             view, made only when something consumes frames.
+ * @parameter: grid: Grid constants
+ * @parameter: sink: Frame outputs
+ * @parameter: trace: Per-phase timings, or NULL
+ * @parameter: metrics: Live metrics export, or NULL
+ * @parameter: report: Stream the tile count goes to
+ * @return:    N/A
+ *******************************************************************************
+ */
+void runTiledSimulation(const WaveGrid* grid, FrameSink* sink, PhaseTrace* trace,
+                        MetricsExport* metrics, FILE* report)
+{
+    TileCount count = { 0, 0, 0 };
+    TiledField levels[3];
+    for (int k = 0; k < 3; k++)
+    {
+        initTiledField(&levels[k], grid->rows, grid->cols, &count);
+    }
+    TiledField* next = &levels[0];
+    TiledField* now = &levels[1];
+    TiledField* prev = &levels[2];
+
+    int framesOut = sink->stream != NULL || sink->renderer != NULL;
+    double** view = framesOut ? allocateView(grid->rows, grid->cols) : NULL;
+    double** energyNext = NULL;
+    double** energyNow = NULL;
+
+    for (int n = 0; n < n_stop; n++)
+    {
+        if (atomic_load(&cancelRequested))
+        {
+            fprintf(report, "Cancelled at step %d of %d\n", n, n_stop);
+            break;
+        }
+        double stepStart = traceBegin(trace);
+        double phaseStart = stepStart;
+
+        updateInteriorTiled(next, now, prev, grid->ox2, grid->oy2);
+        traceEnd(trace, "update_interior", n, phaseStart);
+
+        phaseStart = traceBegin(trace);
+        tiledSet(next, grid->srcRow, grid->srcCol, sourceValue(n * grid->timeStep));
+        traceEnd(trace, "apply_source", n, phaseStart);
+
+        phaseStart = traceBegin(trace);
+        applyTiledBoundaries(next, now, grid);
+        traceEnd(trace, "update_boundaries", n, phaseStart);
+
+        phaseStart = traceBegin(trace);
+        if (framesOut)
+        {
+            copyTiledToView(view, next);
+            emitFrame(sink, (FieldRef){ view, 1, 0 }, grid, n);
+        }
+        traceEnd(trace, "plot_solution", n, phaseStart);
+
+        // The energy needs both levels densely, only copied when asked for
+        if (metrics != NULL)
+        {
+            if (claimEnergyRequest(metrics))
+            {
+                if (energyNext == NULL)
+                {
+                    energyNext = allocateView(grid->rows, grid->cols);
+                    energyNow = allocateView(grid->rows, grid->cols);
+                }
+                copyTiledToView(energyNext, next);
+                copyTiledToView(energyNow, now);
+                storeEnergy(metrics, fieldEnergy((FieldRef){ energyNext, 1, 0 },
+                                                 (FieldRef){ energyNow, 1, 0 }, grid), n);
+            }
+            atomic_store_explicit(&metrics->step, n + 1, memory_order_relaxed);
+        }
+
+        TiledField* temp = prev;
+        prev = now;
+        now = next;
+        next = temp;
+        traceEnd(trace, "step", n, stepStart);
+    }
+
+    fprintf(report, "Tiles: %d of %d allocated at the end, %d at peak\n", count.live,
+            count.total, count.peak);
+
+    for (int k = 0; k < 3; k++)
+    {
+        freeTiledField(&levels[k]);
+    }
+    freeView(view);
+    freeView(energyNext);
+    freeView(energyNow);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Ring buffer holding time level L of a task graph (level 0 is
+ *             the first Un0, level -1 the first Un_m1)
+ * @parameter: graph: Task graph
+ * @parameter: level: Time level
+ * @return:    2D array of that level
+ *******************************************************************************
+ */
+static inline double** taskLevel(TaskGraph* graph, int level)
+{
+    return graph->levels[(level + 1) % TASK_RING_LEVELS];
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Push a ready task onto the bottom of a deque
+ * @parameter: deque: Deque of the worker that made the task ready
+ * @parameter: id: Task id
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void pushTask(TaskDeque* deque, int id)
+{
+    pthread_mutex_lock(&deque->lock);
+    deque->items[deque->bottom++ % deque->capacity] = id;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Take a task from a deque: the newest for its owner, whose
+ *             neighbouring tiles are still in cache, the oldest for a thief
+ * @parameter: deque: Deque to take from
+ * @parameter: steal: 1 to take from the top
+ * @parameter: id: Filled with the task id
+ * @return:    1 if a task was taken
+ *******************************************************************************
+ */
+static int takeTask(TaskDeque* deque, int steal, int* id)
+{
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top)
+    {
+        *id = steal ? deque->items[deque->top++ % deque->capacity]
+                    : deque->items[--deque->bottom % deque->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Number of tasks a task waits on
+ * @parameter: graph: Task graph
+ * @parameter: k: Task within its step: a tile, the snapshot or the probe
+ * @parameter: n: Time step index
+ * @return:    Dependency count
+ *******************************************************************************
+ */
+static int taskDependencies(const TaskGraph* graph, int k, int n)
+{
+    const int tiles = graph->tileCount;
+    if (k >= tiles)
+    {
+        return tiles + (n > 0);
+    }
+
+    int ti = k / graph->tileCols;
+    int tj = k % graph->tileCols;
+    int sides = (ti > 0) + (ti < graph->tileRows - 1) + (tj > 0) + (tj < graph->tileCols - 1);
+    int count = n > 0 ? 1 + sides : 0;
+    count += graph->sink != NULL && n >= TASK_RING_LEVELS;
+    count += graph->metrics != NULL && n >= TASK_RING_LEVELS - 1;
+    return count;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Count down one dependency of a task and queue it once it has
+ *             none left. The task's counter is then re-armed for the same
+ *             task TASK_RING_LEVELS steps later. Nothing releases that one
+ *             before: a tile of step n + R first needs the same tile of step
+ *             n + R - 2, and a snapshot or probe task that releases it needs
+ *             every tile of step n.
+ * @parameter: graph: Task graph
+ * @parameter: deque: Deque of the finishing worker
+ * @parameter: id: Task id
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void releaseTask(TaskGraph* graph, TaskDeque* deque, int id)
+{
+    const int n = id / graph->perStep;
+    const int k = id % graph->perStep;
+    atomic_int* counter = &graph->pending[(n % TASK_RING_LEVELS) * graph->perStep + k];
+
+    if (atomic_fetch_sub_explicit(counter, 1, memory_order_acq_rel) == 1)
+    {
+        if (n + TASK_RING_LEVELS < graph->steps)
+        {
+            atomic_store_explicit(counter, taskDependencies(graph, k, n + TASK_RING_LEVELS),
+                                  memory_order_relaxed);
+        }
+        pushTask(deque, id);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Advance one tile by one time step: interior through the kernel,
+ *             then the source and the radiating boundary nodes and corners
+ *             that lie in the tile. The edge and corner updates only read
+ *             nodes of the same tile, as tiles are at least two nodes wide.
+ * @parameter: graph: Task graph
+ * @parameter: t: Tile index, row major
+ * @parameter: n: Time step index
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void runTileTask(TaskGraph* graph, int t, int n)
+{
+    const WaveGrid* grid = &graph->grid;
+    const int rows = grid->rows;
+    const int cols = grid->cols;
+    double** next = taskLevel(graph, n + 1);
+    double** now = taskLevel(graph, n);
+    double** prev = taskLevel(graph, n - 1);
+
+    int i0 = graph->rowStart[t / graph->tileCols];
+    int i1 = graph->rowStart[t / graph->tileCols + 1];
+    int j0 = graph->colStart[t % graph->tileCols];
+    int j1 = graph->colStart[t % graph->tileCols + 1];
+
+    // The kernels update the interior of the array they are given, so pass a
+    // window of row pointers with one halo node on each side
+    int a0 = i0 < 1 ? 1 : i0;
+    int a1 = i1 > rows - 1 ? rows - 1 : i1;
+    int b0 = j0 < 1 ? 1 : j0;
+    int b1 = j1 > cols - 1 ? cols - 1 : j1;
+    if (a1 > a0 && b1 > b0)
+    {
+        double* windowNext[TASK_TILE + 2];
+        double* windowNow[TASK_TILE + 2];
+        double* windowPrev[TASK_TILE + 2];
+        for (int r = 0; r < a1 - a0 + 2; r++)
+        {
+            windowNext[r] = next[a0 - 1 + r] + b0 - 1;
+            windowNow[r] = now[a0 - 1 + r] + b0 - 1;
+            windowPrev[r] = prev[a0 - 1 + r] + b0 - 1;
+        }
+        graph->kernel(windowNext, windowNow, windowPrev, a1 - a0 + 2, b1 - b0 + 2,
+                      grid->ox2, grid->oy2);
+    }
+
+    if (grid->srcRow >= i0 && grid->srcRow < i1 && grid->srcCol >= j0 && grid->srcCol < j1)
+    {
+        applySource((FieldRef){ next, 1, 0 }, grid, n);
+    }
+
+    // Radiating boundaries, with the expressions of applyBoundaryRows
+    if (i0 == 0)
+    {
+        murStrip(&next[0][b0], &now[1][b0], &next[1][b0], &now[0][b0], b1 - b0, grid->coefX);
+    }
+    if (i1 == rows)
+    {
+        murStrip(&next[rows - 1][b0], &now[rows - 2][b0], &next[rows - 2][b0],
+                 &now[rows - 1][b0], b1 - b0, grid->coefX);
+    }
+    for (int ii = a0; ii < a1; ii++)
+    {
+        if (j0 == 0)
+        {
+            next[ii][0] = now[ii][1] + (grid->coefY * (next[ii][1] - now[ii][0]));
+        }
+        if (j1 == cols)
+        {
+            next[ii][cols - 1] = now[ii][cols - 2]
+                                 + (grid->coefY * (next[ii][cols - 2] - now[ii][cols - 1]));
+        }
+    }
+
+    if (i0 == 0 && j0 == 0)
+    {
+        next[0][0] = 0.5 * (next[1][0] + next[0][1]);
+    }
+    if (i1 == rows && j0 == 0)
+    {
+        next[rows - 1][0] = 0.5 * (next[rows - 2][0] + next[rows - 1][1]);
+    }
+    if (i1 == rows && j1 == cols)
+    {
+        next[rows - 1][cols - 1] = 0.5 * (next[rows - 2][cols - 1] + next[rows - 1][cols - 2]);
+    }
+    if (i0 == 0 && j1 == cols)
+    {
+        next[0][cols - 1] = 0.5 * (next[0][cols - 2] + next[1][cols - 1]);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Run a task and release the tasks that wait on it
+ *             - tile (t, n): tile t and its side neighbours at step n + 1,
+ *               and the snapshot and probe of step n
+ *             - snapshot n: snapshot n + 1, and every tile of step n + R,
+ *               which overwrites the level the snapshot read
+ *             - probe n: probe n + 1, and every tile of step n + R - 1
+ * @parameter: graph: Task graph
+ * @parameter: deque: Deque of the running worker
+ * @parameter: id: Task id
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void runTask(TaskGraph* graph, TaskDeque* deque, int id)
+{
+    const int tiles = graph->tileCount;
+    const int n = id / graph->perStep;
+    const int k = id % graph->perStep;
+
+    if (k < tiles)
+    {
+        runTileTask(graph, k, n);
+
+        if (n + 1 < graph->steps)
+        {
+            int ti = k / graph->tileCols;
+            int tj = k % graph->tileCols;
+            int following = (n + 1) * graph->perStep;
+            releaseTask(graph, deque, following + k);
+            if (ti > 0)
+            {
+                releaseTask(graph, deque, following + k - graph->tileCols);
+            }
+            if (ti < graph->tileRows - 1)
+            {
+                releaseTask(graph, deque, following + k + graph->tileCols);
+            }
+            if (tj > 0)
+            {
+                releaseTask(graph, deque, following + k - 1);
+            }
+            if (tj < graph->tileCols - 1)
+            {
+                releaseTask(graph, deque, following + k + 1);
+            }
+        }
+        if (graph->sink != NULL)
+        {
+            releaseTask(graph, deque, n * graph->perStep + tiles);
+        }
+        if (graph->metrics != NULL)
+        {
+            releaseTask(graph, deque, n * graph->perStep + tiles + 1);
+        }
+        return;
+    }
+
+    int lag;
+    if (k == tiles)
+    {
+        emitFrame(graph->sink, (FieldRef){ taskLevel(graph, n + 1), 1, 0 }, &graph->grid, n);
+        lag = TASK_RING_LEVELS;
+    }
+    else
+    {
+        metricsStep(graph->metrics, (FieldRef){ taskLevel(graph, n + 1), 1, 0 },
+                    (FieldRef){ taskLevel(graph, n), 1, 0 }, &graph->grid, n);
+        lag = TASK_RING_LEVELS - 1;
+    }
+
+    if (n + 1 < graph->steps)
+    {
+        releaseTask(graph, deque, (n + 1) * graph->perStep + k);
+    }
+    if (n + lag < graph->steps)
+    {
+        for (int t = 0; t < tiles; t++)
+        {
+            releaseTask(graph, deque, (n + lag) * graph->perStep + t);
+        }
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Task graph worker. Runs tasks from its own deque, and steals
+ *             the oldest task of another worker when that is empty.
+ * @parameter: arg: TaskWorker
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* taskWorker(void* arg)
+{
+    TaskWorker* worker = (TaskWorker*) arg;
+    TaskGraph* graph = worker->graph;
+    TaskDeque* mine = &graph->deques[worker->index];
+    int spins = 0;
+
+    while (atomic_load_explicit(&graph->finished, memory_order_acquire) < graph->taskCount)
+    {
+        int id;
+        int found = takeTask(mine, 0, &id);
+        for (int v = 1; !found && v < graph->threadCount; v++)
+        {
+            found = takeTask(&graph->deques[(worker->index + v) % graph->threadCount], 1, &id);
+            worker->stolen += found;
+        }
+
+        if (!found)
+        {
+            if (++spins > 64)
+            {
+                sched_yield();
+                spins = 0;
+            }
+            continue;
+        }
+
+        runTask(graph, mine, id);
+        worker->run++;
+        atomic_fetch_add_explicit(&graph->finished, 1, memory_order_acq_rel);
+    }
+    return NULL;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Set up a task graph: the tiles, the zeroed ring of time levels,
+ *             and the dependency counts of the first TASK_RING_LEVELS steps
+ * @parameter: graph: Task graph to fill
+ * @parameter: grid: Grid constants
+ * @parameter: steps: Number of time steps
+ * @parameter: threads: Number of worker threads
+ * @parameter: kernel: Interior update kernel
+ * @parameter: sink: Frame outputs, or NULL for no snapshot tasks
+ * @parameter: metrics: Live metrics export, or NULL for no probe tasks
+ * @return:    N/A
+ *******************************************************************************
+ */
+void initTaskGraph(TaskGraph* graph, const WaveGrid* grid, int steps, int threads,
+                   InteriorKernel kernel, FrameSink* sink, MetricsExport* metrics)
+{
+    const int rows = grid->rows;
+    const int cols = grid->cols;
+    graph->grid = *grid;
+    graph->steps = steps;
+    graph->threadCount = threads;
+    graph->kernel = kernel;
+    graph->sink = sink;
+    graph->metrics = metrics;
+
+    // Even split, so no tile is cut down to a single node
+    graph->tileRows = (rows + TASK_TILE - 1) / TASK_TILE;
+    graph->tileCols = (cols + TASK_TILE - 1) / TASK_TILE;
+    graph->tileCount = graph->tileRows * graph->tileCols;
+    graph->rowStart = (int*) memAlloc((graph->tileRows + 1) * sizeof(int), MEM_RUNTIME);
+    graph->colStart = (int*) memAlloc((graph->tileCols + 1) * sizeof(int), MEM_RUNTIME);
+    for (int r = 0; r <= graph->tileRows; r++)
+    {
+        graph->rowStart[r] = (int)((long) r * rows / graph->tileRows);
+    }
+    for (int q = 0; q <= graph->tileCols; q++)
+    {
+        graph->colStart[q] = (int)((long) q * cols / graph->tileCols);
+    }
+
+    graph->levels = (double***) memAlloc(TASK_RING_LEVELS * sizeof(double**), MEM_RUNTIME);
+    for (int r = 0; r < TASK_RING_LEVELS; r++)
+    {
+        graph->levels[r] = allocate2DArray(rows, cols);
+        initializeArray(graph->levels[r], rows, cols);
+    }
+
+    // Task ids: step * perStep + tile, then the step's snapshot and probe
+    const int tiles = graph->tileCount;
+    graph->perStep = tiles + 2;
+    graph->taskCount = steps * (tiles + (sink != NULL) + (metrics != NULL));
+    atomic_init(&graph->finished, 0);
+    graph->pending = (atomic_int*) memAlloc(TASK_RING_LEVELS * graph->perStep
+                                            * sizeof(atomic_int), MEM_RUNTIME);
+    for (int n = 0; n < TASK_RING_LEVELS; n++)
+    {
+        for (int k = 0; k < graph->perStep; k++)
+        {
+            // The tiles of step 0 are queued right away and never released,
+            // so their counters start armed for step TASK_RING_LEVELS
+            int step = n == 0 && k < tiles ? TASK_RING_LEVELS : n;
+            atomic_init(&graph->pending[n * graph->perStep + k],
+                        step < steps ? taskDependencies(graph, k, step) : 0);
+        }
+    }
+
+    // A tile is ready for at most one step at a time, so no more than a
+    // step's worth of tasks is ever queued. Step 0 is dealt out round robin.
+    graph->deques = (TaskDeque*) memAlloc(threads * sizeof(TaskDeque), MEM_RUNTIME);
+    for (int i = 0; i < threads; i++)
+    {
+        TaskDeque* deque = &graph->deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->capacity = graph->perStep;
+        deque->items = (int*) memAlloc(deque->capacity * sizeof(int), MEM_RUNTIME);
+        deque->top = 0;
+        deque->bottom = 0;
+    }
+    for (int t = 0; t < tiles; t++)
+    {
+        pushTask(&graph->deques[t % threads], t);
+    }
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free a task graph
+ * @parameter: graph: Task graph to free
+ * @return:    N/A
+ *******************************************************************************
+ */
+void freeTaskGraph(TaskGraph* graph)
+{
+    for (int r = 0; r < TASK_RING_LEVELS; r++)
+    {
+        free2DArray(graph->levels[r], graph->grid.rows);
+    }
+    for (int i = 0; i < graph->threadCount; i++)
+    {
+        pthread_mutex_destroy(&graph->deques[i].lock);
+        memFree(graph->deques[i].items);
+    }
+    memFree(graph->levels);
+    memFree(graph->deques);
+    memFree(graph->pending);
+    memFree(graph->rowStart);
+    memFree(graph->colStart);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Run every task of a task graph on its worker pool
+ * @parameter: graph: Initialized task graph
+ * @parameter: report: Stream the task counts go to
+ * @return:    N/A
+ *******************************************************************************
+ */
+void runTaskGraph(TaskGraph* graph, FILE* report)
+{
+    pthread_t threads[TASK_MAX_THREADS];
+    TaskWorker workers[TASK_MAX_THREADS];
+
+    for (int i = 0; i < graph->threadCount; i++)
+    {
+        workers[i] = (TaskWorker){ graph, i, 0, 0 };
+        pthread_create(&threads[i], NULL, taskWorker, &workers[i]);
+    }
+
+    long stolen = 0;
+    for (int i = 0; i < graph->threadCount; i++)
+    {
+        pthread_join(threads[i], NULL);
+        stolen += workers[i].stolen;
+    }
+
+    fprintf(report, "Tasks: %d over %d tiles on %d threads, %ld stolen\n", graph->taskCount,
+            graph->tileCount, graph->threadCount, stolen);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Signal handler that asks the running simulation to stop at the
+ *             end of its current step. The handler resets itself, so a second
+ *             signal ends the process as usual.
+ * @parameter: signum: Signal number
+ * @return:    N/A
+ *******************************************************************************
+ */
+static void requestCancel(int signum)
+{
+    (void) signum;
+    atomic_store(&cancelRequested, 1);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Thread entry of the preview run: the same scheme on the coarse
+ *             grid, each level streamed, and a diagnostics line every
+ *             PREVIEW_REPORT_EVERY steps
+ * @parameter: arg: PreviewRun
+ * @return:    NULL
+ *******************************************************************************
+ */
+void* previewWorker(void* arg)
+{
+    PreviewRun* preview = (PreviewRun*) arg;
+    const WaveGrid* grid = &preview->grid;
+    const int rows = grid->rows;
+    const int cols = grid->cols;
+
+    double** Un_p1 = allocate2DArray(rows, cols);
+    double** Un0 = allocate2DArray(rows, cols);
+    double** Un_m1 = allocate2DArray(rows, cols);
+    initializeArray(Un_p1, rows, cols);
+    initializeArray(Un0, rows, cols);
+    initializeArray(Un_m1, rows, cols);
+    EdgeScratch scratch;
+    allocateEdgeScratch(&scratch, rows > cols ? rows : cols);
+
+    double start = wallTime();
+    int n = 0;
+    for (; n < preview->steps && !atomic_load(&cancelRequested); n++)
+    {
+        FieldRef next = { Un_p1, 1, 0 };
+        FieldRef now = { Un0, 1, 0 };
+        preview->kernel(Un_p1, Un0, Un_m1, rows, cols, grid->ox2, grid->oy2);
+        applySource(next, grid, n);
+        applyBoundaries(next, now, grid, &scratch);
+        streamFrame(&preview->stream, next, grid, n);
+
+        if ((n + 1) % PREVIEW_REPORT_EVERY == 0 || n + 1 == preview->steps)
+        {
+            int peakRow = 0;
+            int peakCol = 0;
+            for (int ii = 0; ii < rows; ii++)
+            {
+                for (int jj = 0; jj < cols; jj++)
+                {
+                    if (fabs(Un_p1[ii][jj]) > fabs(Un_p1[peakRow][peakCol]))
+                    {
+                        peakRow = ii;
+                        peakCol = jj;
+                    }
+                }
+            }
+            fprintf(stderr, "preview: t = %.3e s (%3d%%), peak %+.3e at node (%d, %d), "
+                    "energy %.3e\n", n * grid->timeStep, 100 * (n + 1) / preview->steps,
+                    Un_p1[peakRow][peakCol], peakRow * preview->factor,
+                    peakCol * preview->factor, fieldEnergy(next, now, grid));
+        }
+
+        double** temp = Un_m1;
+        Un_m1 = Un0;
+        Un0 = Un_p1;
+        Un_p1 = temp;
+    }
+    preview->reached = n;
+    preview->elapsed = wallTime() - start;
+
+    free2DArray(Un_p1, rows);
+    free2DArray(Un0, rows);
+    free2DArray(Un_m1, rows);
+    freeEdgeScratch(&scratch);
+    return NULL;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Start a coarse shadow run of the whole job on its own thread.
+ *             The grid is PREVIEW_COARSEN times coarser in x and y with a
+ *             time step that many times larger, which keeps the Courant
+ *             numbers, so it covers the same simulated time in PREVIEW_COARSEN^3
+ *             times less work. Ctrl-C from here on stops the full run cleanly.
+ * @parameter: preview: Preview to fill
+ * @parameter: path: Preview frame stream path
+ * @parameter: grid: Grid constants of the full run
+ * @parameter: kernel: Interior update kernel
+ * @return:    0 on success, -1 if the stream cannot be opened
+ *******************************************************************************
+ */
+int startPreview(PreviewRun* preview, const char* path, const WaveGrid* grid,
+                 InteriorKernel kernel)
+{
+    preview->factor = PREVIEW_COARSEN;
+    preview->grid = coarsenGrid(grid, PREVIEW_COARSEN);
+    preview->kernel = kernel;
+    preview->steps = (n_stop + PREVIEW_COARSEN - 1) / PREVIEW_COARSEN;
+    preview->reached = 0;
+    preview->elapsed = 0.0;
+
+    // A slow viewer only holds up the preview thread, not the full run
+    if (openFrameStream(&preview->stream, path, &preview->grid, 1, 1, 0, STREAM_BLOCK) != 0)
+    {
+        return -1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestCancel;
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &preview->oldInt);
+    sigaction(SIGTERM, &action, &preview->oldTerm);
+
+    // Below about 4 nodes per wavelength the preview shows where the energy
+    // goes but not the phase
+    fprintf(stderr, "preview: %d x %d nodes, %.1f per wavelength, %d steps to %s; Ctrl-C "
+            "stops the full run\n", preview->grid.rows, preview->grid.cols,
+            l / (dx * PREVIEW_COARSEN), preview->steps, path);
+    pthread_create(&preview->thread, NULL, previewWorker, preview);
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Wait for the preview run, close its stream and put back the
+ *             SIGINT and SIGTERM actions it replaced
+ * @parameter: preview: Preview
+ * @return:    N/A
+ *******************************************************************************
+ */
+void finishPreview(PreviewRun* preview)
+{
+    pthread_join(preview->thread, NULL);
+    closeFrameStream(&preview->stream);
+    sigaction(SIGINT, &preview->oldInt, NULL);
+    sigaction(SIGTERM, &preview->oldTerm, NULL);
+    fprintf(stderr, "preview: %d of %d steps in %.3f s\n", preview->reached, preview->steps,
+            preview->elapsed);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Start pull-based time marching: nothing is computed until a
+ *             frame is asked for. Also the entry point of the shared library
+ *             build, so Python can iterate over the solver with ctypes.
+ * @parameter: rows: Nodes in x-direction
+ * @parameter: cols: Nodes in y-direction
+ * @parameter: kernel: Interior kernel name
+ * @parameter: steps: Steps after which the frames end
+ * @return:    Iterator, or NULL for an unknown kernel or a grid that does not
+ *             hold the source node inside its boundary
+ *******************************************************************************
+ */
+FrameIterator* openFrames(int rows, int cols, const char* kernel, int steps)
+{
+    InteriorKernel update = findKernel(kernel);
+    if (update == NULL || rows <= xs1 + 1 || cols <= ys1 + 1)
+    {
+        return NULL;
+    }
+
+    FrameIterator* frames = (FrameIterator*) memAlloc(sizeof(FrameIterator), MEM_RUNTIME);
+    frames->grid = makeGrid(rows, cols);
+    frames->kernel = update;
+    frames->steps = steps;
+    frames->step = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        frames->levels[k] = allocate2DArray(rows, cols);
+        initializeArray(frames->levels[k], rows, cols);
+    }
+    allocateEdgeScratch(&frames->scratch, rows > cols ? rows : cols);
+    return frames;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Advance skip + 1 steps and return the newest time level, in
+ *             place: row ii starts frameStride(frames) * ii doubles after the
+ *             returned pointer. It stays valid until the next call and must
+ *             not be written to.
+ * @parameter: frames: Iterator
+ * @parameter: skip: Steps to take without returning them
+ * @return:    Newest time level, or NULL for a negative skip or when fewer
+ *             than skip + 1 steps are left
+ *******************************************************************************
+ */
+const double* nextFrame(FrameIterator* frames, int skip)
+{
+    const WaveGrid* grid = &frames->grid;
+    if (skip < 0 || frames->step + skip + 1 > frames->steps)
+    {
+        return NULL;
+    }
+
+    for (int k = 0; k <= skip; k++)
+    {
+        double** Un_p1 = frames->levels[0];
+        double** Un0 = frames->levels[1];
+        double** Un_m1 = frames->levels[2];
+
+        frames->kernel(Un_p1, Un0, Un_m1, grid->rows, grid->cols, grid->ox2, grid->oy2);
+        applySource((FieldRef){ Un_p1, 1, 0 }, grid, frames->step);
+        applyBoundaries((FieldRef){ Un_p1, 1, 0 }, (FieldRef){ Un0, 1, 0 }, grid,
+                        &frames->scratch);
+
+        frames->levels[0] = Un_m1;
+        frames->levels[1] = Un_p1;
+        frames->levels[2] = Un0;
+        frames->step++;
+    }
+
+    return frames->levels[1][0];
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Doubles from one row of a frame to the next
+ * @parameter: frames: Iterator
+ * @return:    Row stride
+ *******************************************************************************
+ */
+int frameStride(const FrameIterator* frames)
+{
+    return rowStride(frames->grid.cols);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Index n of the time step that produced the last frame, as in
+ *             the display and WaveSimulation2D.frames. A frame stream header
+ *             carries the steps taken, n + 1, for the same frame.
+ * @parameter: frames: Iterator
+ * @return:    Step index, -1 before the first frame
+ *******************************************************************************
+ */
+int frameStep(const FrameIterator* frames)
+{
+    return frames->step - 1;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Free an iterator from openFrames
+ * @parameter: frames: Iterator
+ * @return:    N/A
+ *******************************************************************************
+ */
+void closeFrames(FrameIterator* frames)
+{
+    for (int k = 0; k < 3; k++)
+    {
+        free2DArray(frames->levels[k], frames->grid.rows);
+    }
+    freeEdgeScratch(&frames->scratch);
+    memFree(frames);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Print the command line usage
+ * @parameter: program: Program name
+ * @return:    N/A
+ *******************************************************************************
+ */
+void printUsage(const char* program)
+{
+    fprintf(stderr,
+            "usage: %s [bench|cliffs|plan|bloch|survey|replay] [options]\n"
+            "  --grid=ROWSxCOLS                   grid nodes in x and y instead of Nx x Ny\n"
+            "  --kernel=scalar|simd|blocked       interior update kernel\n"
+            "  --layout=separate|interleaved|tiled  time level storage\n"
+            "  --pipeline=N                       pipelined steps on N threads\n"
+            "  --parareal=N                       Parareal over N time slices\n"
+            "  --tasks=N                          tile task graph on N work-stealing threads\n"
+            "  --stream=PATH                      binary frames to PATH, - is stdout\n"
+            "  --stream-every=K                   stream every K-th step\n"
+            "  --stream-stride=S                  keep every S-th node in x and y\n"
+            "  --stream-policy=block|drop|coalesce  slow consumer policy\n"
+            "  --stream-pyramid=L                 also write 2x .. 2^L max-abs levels to PATH.1 ..\n"
+            "  --trace=PATH                       per-phase timings as Chrome trace JSON\n"
+            "  --metrics=PATH                     live metrics in PATH.prom and PATH.json\n"
+            "  --metrics-every=SECONDS            metrics snapshot interval\n"
+            "  --no-display                       do not print frames to the terminal\n"
+            "  --render=text|sixel|kitty          terminal display of frames\n"
+            "  --render-scale=K                   sixel and kitty: pixels per node\n"
+            "  --checkpoint=PATH                  append incremental checkpoints to PATH\n"
+            "  --checkpoint-every=K               checkpoint every K-th step\n"
+            "  --checkpoint-full=F                every F-th checkpoint is a full image\n"
+            "  --restore=PATH                     resume from the checkpoint chain in PATH\n"
+            "  --preview=PATH                     coarse preview run streamed to PATH alongside\n"
+            "  --record=PATH                      record the field around --record-region;\n"
+            "                                     replay: the recording to re-simulate\n"
+            "  --record-region=R0,C0,R1,C1        rows R0..R1-1 and columns C0..C1-1\n"
+            "  --cliff-range=FROM,TO              cliffs: n x n grid sizes to scan\n"
+            "  --cliff-step=K                     cliffs: grid size increment\n"
+            "  --distance=METRES                  plan: propagation distance\n"
+            "  --phase-error=RADIANS              plan: phase error budget\n"
+            "  --bloch-points=N                   bloch: k-points per path segment\n"
+            "  --bloch-rod=R                      bloch: rod radius as a fraction of the period\n"
+            "  --sources=PATH                     survey: \"row col\" source list\n"
+            "  --receivers=PATH                   survey: \"row col\" receiver list\n"
+            "  --survey-mode=auto|direct|reciprocal|check  survey: which nodes are fired\n"
+            "  --survey-out=PATH                  survey: traces by source and receiver\n"
+            "  --encode=polarity|delay            survey: fire all sources at once, then deblend\n"
+            "  --encode-runs=M                    survey: encoded runs\n"
+            "  --obstacle=ROW,COL,RADIUS          replay: zero field disc inside the region\n"
+            "  --replay-padding=P                 replay: nodes of padding around the region\n",
+            program);
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Parse the command line
+ * @parameter: argc: Argument count
+ * @parameter: argv: Argument vector
+ * @parameter: options: Filled with the parsed options
+ * @return:    0 on success, -1 on a bad argument
+ *******************************************************************************
+ */
+int parseOptions(int argc, char** argv, SimOptions* options)
+{
+    options->benchmark = 0;
+    options->rows = Nx;
+    options->cols = Ny;
+    options->plan = 0;
+    options->planDistance = 0.0;
+    options->planBudget = PLAN_PHASE_ERROR;
+    options->bloch = 0;
+    options->blochPoints = 8;
+    options->blochRod = 0.0;
+    options->survey = 0;
+    options->surveyMode = SURVEY_AUTO;
+    options->sourcePath = NULL;
+    options->receiverPath = NULL;
+    options->surveyPath = NULL;
+    options->encoding = ENCODE_NONE;
+    options->encodeRuns = SURVEY_ENCODE_RUNS;
+    options->kernel = kernelTable[0].kernel;
+    options->layout = LAYOUT_SEPARATE;
+    options->pipeline = 0;
+    options->parareal = 0;
+    options->tasks = 0;
+    options->streamPath = NULL;
+    options->streamEvery = 1;
+    options->streamStride = 1;
+    options->streamLevels = 0;
+    options->streamPolicy = STREAM_BLOCK;
+    options->tracePath = NULL;
+    options->metricsPath = NULL;
+    options->metricsEvery = METRICS_INTERVAL;
+    options->render = RENDER_TEXT;
+    options->renderScale = RENDER_SCALE;
+    options->checkpointPath = NULL;
+    options->checkpointEvery = CHECKPOINT_EVERY;
+    options->checkpointFull = CHECKPOINT_FULL_EVERY;
+    options->restorePath = NULL;
+    options->recordPath = NULL;
+    options->region[0] = 0;
+    options->region[2] = 0;
+    options->replay = 0;
+    options->obstacle[2] = 0;
+    options->replayPadding = REPLAY_PADDING;
+    options->previewPath = NULL;
+    options->cliffs = 0;
+    options->cliffFrom = CLIFF_FROM;
+    options->cliffTo = CLIFF_TO;
+    options->cliffStep = CLIFF_STEP;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "bench") == 0)
+        {
+            options->benchmark = 1;
+        }
+        else if (strcmp(argv[i], "cliffs") == 0)
+        {
+            options->cliffs = 1;
+        }
+        else if (strncmp(argv[i], "--cliff-range=", 14) == 0)
+        {
+            char extra;
+            if (sscanf(argv[i] + 14, "%d,%d%c", &options->cliffFrom, &options->cliffTo,
+                       &extra) != 2 || options->cliffFrom < 3
+                || options->cliffTo < options->cliffFrom)
+            {
+                fprintf(stderr, "--cliff-range needs FROM,TO with 3 <= FROM <= TO\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--cliff-step=", 13) == 0)
+        {
+            options->cliffStep = atoi(argv[i] + 13);
+            if (options->cliffStep < 1)
+            {
+                fprintf(stderr, "--cliff-step needs a positive size increment\n");
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "plan") == 0)
+        {
+            options->plan = 1;
+        }
+        else if (strcmp(argv[i], "bloch") == 0)
+        {
+            options->bloch = 1;
+        }
+        else if (strncmp(argv[i], "--bloch-points=", 15) == 0)
+        {
+            options->blochPoints = atoi(argv[i] + 15);
+            if (options->blochPoints < 1 || options->blochPoints > BLOCH_MAX_POINTS)
+            {
+                fprintf(stderr, "--bloch-points needs 1 to %d points\n", BLOCH_MAX_POINTS);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--bloch-rod=", 12) == 0)
+        {
+            options->blochRod = strtod(argv[i] + 12, NULL);
+            if (options->blochRod < 0.0 || options->blochRod >= 0.5)
+            {
+                fprintf(stderr, "--bloch-rod needs a radius in [0, 0.5)\n");
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "replay") == 0)
+        {
+            options->replay = 1;
+        }
+        else if (strncmp(argv[i], "--record=", 9) == 0)
+        {
+            options->recordPath = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--record-region=", 16) == 0)
+        {
+            int* r = options->region;
+            char extra;
+            if (sscanf(argv[i] + 16, "%d,%d,%d,%d%c", &r[0], &r[1], &r[2], &r[3], &extra) != 4
+                || r[2] - r[0] < 2 || r[3] - r[1] < 2)
+            {
+                fprintf(stderr, "--record-region needs R0,C0,R1,C1 at least 2 nodes apart\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--obstacle=", 11) == 0)
+        {
+            int* o = options->obstacle;
+            char extra;
+            if (sscanf(argv[i] + 11, "%d,%d,%d%c", &o[0], &o[1], &o[2], &extra) != 3 || o[2] < 1)
+            {
+                fprintf(stderr, "--obstacle needs ROW,COL,RADIUS with a positive radius\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--replay-padding=", 17) == 0)
+        {
+            options->replayPadding = atoi(argv[i] + 17);
+            if (options->replayPadding < 1)
+            {
+                fprintf(stderr, "--replay-padding needs a positive node count\n");
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "survey") == 0)
+        {
+            options->survey = 1;
+        }
+        else if (strncmp(argv[i], "--sources=", 10) == 0)
+        {
+            options->sourcePath = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--receivers=", 12) == 0)
+        {
+            options->receiverPath = argv[i] + 12;
+        }
+        else if (strncmp(argv[i], "--survey-out=", 13) == 0)
+        {
+            options->surveyPath = argv[i] + 13;
+        }
+        else if (strcmp(argv[i], "--encode=polarity") == 0)
+        {
+            options->encoding = ENCODE_POLARITY;
+        }
+        else if (strcmp(argv[i], "--encode=delay") == 0)
+        {
+            options->encoding = ENCODE_DELAY;
+        }
+        else if (strncmp(argv[i], "--encode-runs=", 14) == 0)
+        {
+            options->encodeRuns = atoi(argv[i] + 14);
+            if (options->encodeRuns < 1)
+            {
+                fprintf(stderr, "--encode-runs needs a positive run count\n");
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--survey-mode=auto") == 0)
+        {
+            options->surveyMode = SURVEY_AUTO;
+        }
+        else if (strcmp(argv[i], "--survey-mode=direct") == 0)
+        {
+            options->surveyMode = SURVEY_DIRECT;
+        }
+        else if (strcmp(argv[i], "--survey-mode=reciprocal") == 0)
+        {
+            options->surveyMode = SURVEY_RECIPROCAL;
+        }
+        else if (strcmp(argv[i], "--survey-mode=check") == 0)
+        {
+            options->surveyMode = SURVEY_CHECK;
+        }
+        else if (strncmp(argv[i], "--distance=", 11) == 0)
+        {
+            options->planDistance = strtod(argv[i] + 11, NULL);
+            if (options->planDistance <= 0.0)
+            {
+                fprintf(stderr, "--distance needs a positive length in metres\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--phase-error=", 14) == 0)
+        {
+            options->planBudget = strtod(argv[i] + 14, NULL);
+            if (options->planBudget <= 0.0)
+            {
+                fprintf(stderr, "--phase-error needs a positive budget in radians\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--grid=", 7) == 0)
+        {
+            char extra;
+            if (sscanf(argv[i] + 7, "%dx%d%c", &options->rows, &options->cols, &extra) != 2
+                || options->rows <= xs1 + 1 || options->cols <= ys1 + 1)
+            {
+                fprintf(stderr, "--grid needs ROWSxCOLS with the source node (%d, %d) inside\n",
+                        xs1, ys1);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--kernel=", 9) == 0)
+        {
+            options->kernel = findKernel(argv[i] + 9);
+            if (options->kernel == NULL)
+            {
+                fprintf(stderr, "unknown kernel: %s\n", argv[i] + 9);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--layout=separate") == 0)
+        {
+            options->layout = LAYOUT_SEPARATE;
+        }
+        else if (strcmp(argv[i], "--layout=interleaved") == 0)
+        {
+            options->layout = LAYOUT_INTERLEAVED;
+        }
+        else if (strcmp(argv[i], "--layout=tiled") == 0)
+        {
+            options->layout = LAYOUT_TILED;
+        }
+        else if (strncmp(argv[i], "--pipeline=", 11) == 0)
+        {
+            options->pipeline = atoi(argv[i] + 11);
+            if (options->pipeline < 1 || options->pipeline > PIPELINE_MAX_THREADS)
+            {
+                fprintf(stderr, "--pipeline needs 1 to %d threads\n", PIPELINE_MAX_THREADS);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--tasks=", 8) == 0)
         {
-            Un_p1[ii][jj] = Un0[ii][jj + 1] + (((c * dt - dy) / (c * dt + dy))
-                                            * (Un_p1[ii][jj + 1] - Un0[ii][jj]));
+            options->tasks = atoi(argv[i] + 8);
+            if (options->tasks < 1 || options->tasks > TASK_MAX_THREADS)
+            {
+                fprintf(stderr, "--tasks needs 1 to %d threads\n", TASK_MAX_THREADS);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--parareal=", 11) == 0)
+        {
+            options->parareal = atoi(argv[i] + 11);
+            if (options->parareal < 1 || options->parareal > PARAREAL_MAX_SLICES)
+            {
+                fprintf(stderr, "--parareal needs 1 to %d slices\n", PARAREAL_MAX_SLICES);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--stream=", 9) == 0)
+        {
+            options->streamPath = argv[i] + 9;
+        }
+        else if (strncmp(argv[i], "--stream-every=", 15) == 0)
+        {
+            options->streamEvery = atoi(argv[i] + 15);
+            if (options->streamEvery < 1)
+            {
+                fprintf(stderr, "--stream-every needs a positive step count\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--stream-stride=", 16) == 0)
+        {
+            options->streamStride = atoi(argv[i] + 16);
+            if (options->streamStride < 1)
+            {
+                fprintf(stderr, "--stream-stride needs a positive node count\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--stream-pyramid=", 17) == 0)
+        {
+            options->streamLevels = atoi(argv[i] + 17);
+            if (options->streamLevels < 1 || options->streamLevels > STREAM_MAX_LEVELS)
+            {
+                fprintf(stderr, "--stream-pyramid needs 1 to %d levels\n", STREAM_MAX_LEVELS);
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            options->tracePath = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--metrics=", 10) == 0)
+        {
+            options->metricsPath = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--metrics-every=", 16) == 0)
+        {
+            options->metricsEvery = strtod(argv[i] + 16, NULL);
+            if (options->metricsEvery <= 0.0)
+            {
+                fprintf(stderr, "--metrics-every needs a positive interval in seconds\n");
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--no-display") == 0)
+        {
+            options->render = RENDER_NONE;
+        }
+        else if (strcmp(argv[i], "--render=text") == 0)
+        {
+            options->render = RENDER_TEXT;
+        }
+        else if (strcmp(argv[i], "--render=sixel") == 0)
+        {
+            options->render = RENDER_SIXEL;
+        }
+        else if (strcmp(argv[i], "--render=kitty") == 0)
+        {
+            options->render = RENDER_KITTY;
+        }
+        else if (strncmp(argv[i], "--render-scale=", 15) == 0)
+        {
+            options->renderScale = atoi(argv[i] + 15);
+            if (options->renderScale < 1)
+            {
+                fprintf(stderr, "--render-scale needs a positive pixel count\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--checkpoint=", 13) == 0)
+        {
+            options->checkpointPath = argv[i] + 13;
+        }
+        else if (strncmp(argv[i], "--checkpoint-every=", 19) == 0)
+        {
+            options->checkpointEvery = atoi(argv[i] + 19);
+            if (options->checkpointEvery < 1)
+            {
+                fprintf(stderr, "--checkpoint-every needs a positive step count\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--checkpoint-full=", 18) == 0)
+        {
+            options->checkpointFull = atoi(argv[i] + 18);
+            if (options->checkpointFull < 1)
+            {
+                fprintf(stderr, "--checkpoint-full needs a positive checkpoint count\n");
+                return -1;
+            }
+        }
+        else if (strncmp(argv[i], "--restore=", 10) == 0)
+        {
+            options->restorePath = argv[i] + 10;
+        }
+        else if (strncmp(argv[i], "--preview=", 10) == 0)
+        {
+            options->previewPath = argv[i] + 10;
+        }
+        else if (strcmp(argv[i], "--stream-policy=block") == 0)
+        {
+            options->streamPolicy = STREAM_BLOCK;
+        }
+        else if (strcmp(argv[i], "--stream-policy=drop") == 0)
+        {
+            options->streamPolicy = STREAM_DROP;
+        }
+        else if (strcmp(argv[i], "--stream-policy=coalesce") == 0)
+        {
+            options->streamPolicy = STREAM_COALESCE;
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    if (options->layout == LAYOUT_TILED && options->kernel != kernelTable[0].kernel)
+    {
+        fprintf(stderr, "--layout=tiled updates tiles with the %s kernel only\n",
+                kernelTable[0].name);
+        return -1;
+    }
+
+    if (options->layout == LAYOUT_INTERLEAVED && options->kernel != kernelTable[0].kernel)
+    {
+        fprintf(stderr, "--layout=interleaved has its own kernel, use --kernel=%s with it\n",
+                kernelTable[0].name);
+        return -1;
+    }
+
+    int runModes = (options->pipeline > 0) + (options->parareal > 0) + (options->tasks > 0);
+    if (runModes > 1)
+    {
+        fprintf(stderr, "--pipeline, --parareal and --tasks are separate run modes, give one\n");
+        return -1;
+    }
+
+    if (runModes > 0
+        && (options->benchmark || options->cliffs || options->plan || options->bloch
+            || options->survey || options->replay))
+    {
+        fprintf(stderr, "--pipeline, --parareal and --tasks are run modes of the simulation, not "
+                "of bench, cliffs, plan, bloch, survey or replay\n");
+        return -1;
+    }
+
+    if (options->pipeline > 0 && options->layout != LAYOUT_SEPARATE)
+    {
+        fprintf(stderr, "--pipeline needs --layout=separate\n");
+        return -1;
+    }
+
+    if (options->streamPath != NULL
+        && (options->parareal > 0 || options->benchmark || options->cliffs || options->plan
+            || options->bloch || options->survey))
+    {
+        fprintf(stderr, "--stream needs a run that produces frames, not --parareal, bench, "
+                "cliffs, plan, bloch or survey\n");
+        return -1;
+    }
+
+    if (options->streamLevels > 0
+        && (options->streamPath == NULL || strcmp(options->streamPath, "-") == 0))
+    {
+        fprintf(stderr, "--stream-pyramid needs --stream=PATH with a file path\n");
+        return -1;
+    }
+
+    if (options->tracePath != NULL
+        && (options->pipeline > 0 || options->parareal > 0 || options->benchmark
+            || options->cliffs || options->plan || options->bloch || options->survey
+            || options->replay))
+    {
+        fprintf(stderr, "--trace needs serial time marching, without --pipeline or --parareal\n");
+        return -1;
+    }
+
+    if (options->metricsPath != NULL
+        && (options->pipeline > 0 || options->parareal > 0 || options->benchmark
+            || options->cliffs || options->plan || options->bloch || options->survey
+            || options->replay))
+    {
+        fprintf(stderr, "--metrics needs serial or --tasks time marching, without --pipeline "
+                "or --parareal\n");
+        return -1;
+    }
+
+    if (options->tasks > 0 && (options->layout != LAYOUT_SEPARATE || options->tracePath != NULL))
+    {
+        fprintf(stderr, "--tasks needs --layout=separate, without --trace\n");
+        return -1;
+    }
+
+    if ((options->checkpointPath != NULL || options->restorePath != NULL)
+        && (options->pipeline > 0 || options->parareal > 0 || options->tasks > 0
+            || options->layout == LAYOUT_TILED))
+    {
+        fprintf(stderr, "--checkpoint and --restore need serial time marching on a dense layout\n");
+        return -1;
+    }
+
+    if (options->previewPath != NULL
+        && (strcmp(options->previewPath, "-") == 0 || options->benchmark || options->cliffs
+            || options->plan
+            || options->bloch || options->survey || options->replay || options->pipeline > 0
+            || options->parareal > 0 || options->tasks > 0))
+    {
+        fprintf(stderr, "--preview needs a file path and serial time marching\n");
+        return -1;
+    }
+
+    if (options->replay && options->recordPath == NULL)
+    {
+        fprintf(stderr, "replay needs --record=PATH\n");
+        return -1;
+    }
+
+    if (!options->replay && options->recordPath != NULL)
+    {
+        const int* r = options->region;
+        if (r[2] == 0)
+        {
+            fprintf(stderr, "--record needs --record-region\n");
+            return -1;
+        }
+        if (r[0] < 1 || r[1] < 1 || r[2] > options->rows - 1 || r[3] > options->cols - 1)
+        {
+            fprintf(stderr, "--record-region must stay off the outer boundary of the %d x %d "
+                    "grid\n", options->rows, options->cols);
+            return -1;
+        }
+        if (options->pipeline > 0 || options->parareal > 0 || options->tasks > 0
+            || options->layout == LAYOUT_TILED || options->restorePath != NULL)
+        {
+            fprintf(stderr, "--record needs serial time marching on a dense layout from step 0\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Serial time marching
+ * @parameter: grid: Grid constants
+ * @parameter: options: Command line options
+ * @parameter: sink: Frame outputs
+ * @parameter: trace: Per-phase timings, or NULL
+ * @parameter: metrics: Live metrics export, or NULL
+ * @return:    0 on success, 1 if a checkpoint chain cannot be used
+ *******************************************************************************
+ */
+int runSimulation(const WaveGrid* grid, const SimOptions* options, FrameSink* sink,
+                  PhaseTrace* trace, MetricsExport* metrics)
+{
+    const int rows = grid->rows;
+    const int cols = grid->cols;
+    FILE* report = sink->stream != NULL && sink->stream->fd == STDOUT_FILENO ? stderr : stdout;
+
+    if (options->layout == LAYOUT_TILED)
+    {
+        runTiledSimulation(grid, sink, trace, metrics, report);
+        return 0;
+    }
+
+    // Allocate memory for 2D arrays, the interleaved layout keeps Un0 and
+    // Un_m1 of each node side by side in U and writes Un_p1 over Un_m1
+    int interleaved = (options->layout == LAYOUT_INTERLEAVED);
+    double** Un_p1 = NULL;
+    double** Un0 = NULL;
+    double** Un_m1 = NULL;
+    double** U = NULL;
+    int cur = 0;
+
+    EdgeScratch scratch;
+    allocateEdgeScratch(&scratch, rows > cols ? rows : cols);
+
+    if (interleaved)
+    {
+        U = allocate2DArray(rows, 2 * cols);
+        initializeArray(U, rows, 2 * cols);
+    }
+    else
+    {
+        Un_p1 = allocate2DArray(rows, cols);
+        Un0 = allocate2DArray(rows, cols);
+        Un_m1 = allocate2DArray(rows, cols);
+
+        initializeArray(Un_p1, rows, cols);
+        initializeArray(Un0, rows, cols);
+        initializeArray(Un_m1, rows, cols);
+    }
+
+    // Resume from a checkpoint chain, and append to it if it is also the
+    // checkpoint output
+    int first = 0;
+    int status = 0;
+    long keep = -1;
+    if (options->restorePath != NULL)
+    {
+        first = interleaved
+                ? restoreCheckpoint(options->restorePath, grid, (FieldRef){ U, 2, 0 },
+                                    (FieldRef){ U, 2, 1 }, &keep)
+                : restoreCheckpoint(options->restorePath, grid, (FieldRef){ Un0, 1, 0 },
+                                    (FieldRef){ Un_m1, 1, 0 }, &keep);
+        status = first < 0;
+        if (options->checkpointPath == NULL
+            || strcmp(options->checkpointPath, options->restorePath) != 0)
+        {
+            keep = -1;
+        }
+    }
+    CheckpointChain chain;
+    int checkpoints = options->checkpointPath != NULL && status == 0;
+    if (checkpoints && openCheckpoint(&chain, options->checkpointPath, grid,
+                                      options->checkpointEvery, options->checkpointFull,
+                                      keep) != 0)
+    {
+        checkpoints = 0;
+        status = 1;
+    }
+
+    // Field around a region, for re-simulating it later
+    RegionRecord record;
+    int recording = options->recordPath != NULL && status == 0;
+    if (recording && openRegionRecord(&record, options->recordPath, grid, options->region,
+                                      n_stop) != 0)
+    {
+        recording = 0;
+        status = 1;
+    }
+
+    // Time marchings starts here
+    for (int n = status == 0 ? first : n_stop; n < n_stop; n++)
+    {
+        // Stop cleanly, the checkpoint chain stays usable for --restore
+        if (atomic_load(&cancelRequested))
+        {
+            fprintf(report, "Cancelled at step %d of %d\n", n, n_stop);
+            break;
+        }
+        FieldRef next;
+        FieldRef now;
+        double stepStart = traceBegin(trace);
+        double phaseStart = stepStart;
+
+        // Compute the general wave equation solution
+        if (interleaved)
+        {
+            updateInteriorInterleaved(U, rows, cols, cur, grid->ox2, grid->oy2);
+            next = (FieldRef){ U, 2, 1 - cur };
+            now = (FieldRef){ U, 2, cur };
+        }
+        else
+        {
+            options->kernel(Un_p1, Un0, Un_m1, rows, cols, grid->ox2, grid->oy2);
+            next = (FieldRef){ Un_p1, 1, 0 };
+            now = (FieldRef){ Un0, 1, 0 };
         }
+        traceEnd(trace, "update_interior", n, phaseStart);
 
-        // Simply average the corner values
-        Un_p1[0][0] = 0.5 * (Un_p1[1][0] + Un_p1[0][1]);
-        Un_p1[Nx - 1][0] = 0.5 * (Un_p1[Nx - 2][0] + Un_p1[Nx - 1][1]);
-        Un_p1[Nx - 1][Ny - 1] = 0.5 * (Un_p1[Nx - 2][Ny - 1] + Un_p1[Nx - 1][Ny - 2]);
-        Un_p1[0][Ny - 1] = 0.5 * (Un_p1[0][Ny - 2] + Un_p1[1][Ny - 1]);
+        // Source nodes
+        phaseStart = traceBegin(trace);
+        applySource(next, grid, n);
+        traceEnd(trace, "apply_source", n, phaseStart);
+
+        // Radiating boundaries and corners
+        phaseStart = traceBegin(trace);
+        applyBoundaries(next, now, grid, &scratch);
+        traceEnd(trace, "update_boundaries", n, phaseStart);
 
-        // Console print :)
-        printWave(Un_p1, Nx, Ny);
+        // Console print :) and other outputs
+        phaseStart = traceBegin(trace);
+        emitFrame(sink, next, grid, n);
+        traceEnd(trace, "plot_solution", n, phaseStart);
+        metricsStep(metrics, next, now, grid, n);
+        if (recording)
+        {
+            recordRegionStep(&record, next);
+        }
 
         // Swap references
-        double** temp = Un_m1;
-        Un_m1 = Un0;
-        Un0 = Un_p1;
-        Un_p1 = temp;
+        if (interleaved)
+        {
+            cur = 1 - cur;
+        }
+        else
+        {
+            double** temp = Un_m1;
+            Un_m1 = Un0;
+            Un0 = Un_p1;
+            Un_p1 = temp;
+        }
+
+        if (checkpoints && (n + 1) % chain.every == 0)
+        {
+            if (interleaved)
+            {
+                writeCheckpoint(&chain, (FieldRef){ U, 2, cur }, (FieldRef){ U, 2, 1 - cur },
+                                n + 1);
+            }
+            else
+            {
+                writeCheckpoint(&chain, (FieldRef){ Un0, 1, 0 }, (FieldRef){ Un_m1, 1, 0 },
+                                n + 1);
+            }
+        }
+        traceEnd(trace, "step", n, stepStart);
+    }
+
+    if (checkpoints)
+    {
+        closeCheckpoint(&chain, report);
+    }
+    if (recording)
+    {
+        closeRegionRecord(&record);
     }
+
     // Free the memory
-    free2DArray(Un_p1, Nx);
-    free2DArray(Un0, Nx);
-    free2DArray(Un_m1, Nx);
+    if (interleaved)
+    {
+        free2DArray(U, rows);
+    }
+    else
+    {
+        free2DArray(Un_p1, rows);
+        free2DArray(Un0, rows);
+        free2DArray(Un_m1, rows);
+    }
+    freeEdgeScratch(&scratch);
+    return status;
+}
 
-    return 0;
+
+// The shared library build (-DWAVE_SIM_LIBRARY) has no main
+#ifndef WAVE_SIM_LIBRARY
+/**
+ *******************************************************************************
+ * @brief:     Serial or task graph time marching with its optional preview,
+ *             trace and metrics. The preview starts first, so nothing else
+ *             is running yet if its stream cannot be opened.
+ * @parameter: grid: Grid constants
+ * @parameter: options: Parsed options
+ * @parameter: sink: Frame outputs
+ * @parameter: report: Stream the run reports go to
+ * @return:    0 on success, 1 on failure
+ *******************************************************************************
+ */
+int runSerialJob(const WaveGrid* grid, const SimOptions* options, FrameSink* sink,
+                 FILE* report)
+{
+    int status = 0;
+
+    // Coarse shadow run on one more thread, its frames come in first
+    PreviewRun preview;
+    if (options->previewPath != NULL
+        && startPreview(&preview, options->previewPath, grid, options->kernel) != 0)
+    {
+        return 1;
+    }
+
+    PhaseTrace trace;
+    if (options->tracePath != NULL)
+    {
+        initTrace(&trace, 5 * n_stop);
+    }
+    MetricsExport metrics;
+    if (options->metricsPath != NULL)
+    {
+        startMetrics(&metrics, options->metricsPath, options->metricsEvery, grid, n_stop,
+                     sink->stream);
+    }
+
+    if (options->tasks > 0)
+    {
+        // Tile tasks on a work-stealing pool, no per-step barrier
+        TaskGraph graph;
+        initTaskGraph(&graph, grid, n_stop, options->tasks, options->kernel,
+                      sink->stream != NULL || sink->renderer != NULL ? sink : NULL,
+                      options->metricsPath != NULL ? &metrics : NULL);
+        runTaskGraph(&graph, report);
+        freeTaskGraph(&graph);
+    }
+    else
+    {
+        status = runSimulation(grid, options, sink, options->tracePath != NULL ? &trace : NULL,
+                               options->metricsPath != NULL ? &metrics : NULL);
+    }
+
+    if (options->previewPath != NULL)
+    {
+        finishPreview(&preview);
+    }
+
+    if (options->metricsPath != NULL)
+    {
+        stopMetrics(&metrics);
+    }
+
+    if (options->tracePath != NULL)
+    {
+        status |= writeTrace(&trace, options->tracePath, grid) != 0;
+        freeTrace(&trace);
+    }
+
+    return status;
+}
+
+/**
+ *******************************************************************************
+ * @brief:     Main function of the file
+ * @parameter: argc: Argument count
+ * @parameter: argv: Argument vector
+ * @return:    Exit status
+ *******************************************************************************
+ */
+int main(int argc, char** argv)
+{
+    SimOptions options;
+    if (parseOptions(argc, argv, &options) != 0)
+    {
+        return 1;
+    }
+
+    WaveGrid grid = makeGrid(options.rows, options.cols);
+    int status = 0;
+
+    // The binary stream replaces the terminal display
+    int framesOut = !options.benchmark && !options.cliffs && !options.plan && !options.bloch
+                    && !options.survey && !options.replay && options.parareal == 0;
+    FrameStream stream;
+    FrameSink sink = { NULL, NULL };
+    if (options.streamPath != NULL && framesOut)
+    {
+        if (openFrameStream(&stream, options.streamPath, &grid, options.streamEvery,
+                            options.streamStride, options.streamLevels,
+                            options.streamPolicy) != 0)
+        {
+            return 1;
+        }
+        sink.stream = &stream;
+    }
+    FrameRenderer renderer;
+    if (framesOut && sink.stream == NULL && options.render != RENDER_NONE)
+    {
+        initRenderer(&renderer, options.render, options.renderScale, grid.rows, grid.cols);
+        sink.renderer = &renderer;
+    }
+    FILE* report = (sink.stream != NULL && stream.fd == STDOUT_FILENO) ? stderr : stdout;
+
+    if (options.benchmark)
+    {
+        status = runBenchmark();
+    }
+    else if (options.cliffs)
+    {
+        status = runCliffScan(options.kernel, options.cliffFrom, options.cliffTo,
+                              options.cliffStep);
+    }
+    else if (options.plan)
+    {
+        // Report only, nothing is simulated
+        return runGridPlan(options.planDistance, options.planBudget);
+    }
+    else if (options.bloch)
+    {
+        status = runBlochSweep(options.blochPoints, options.blochRod);
+    }
+    else if (options.survey)
+    {
+        status = runSurvey(&grid, &options);
+    }
+    else if (options.replay)
+    {
+        // Only the recorded region, streamed to --stream if given
+        status = runRegionReplay(&options);
+    }
+    else if (options.parareal > 0)
+    {
+        // Parallel-in-time run, prints a convergence and speedup report
+        status = runParareal(&grid, options.kernel, n_stop, options.parareal);
+    }
+    else if (options.pipeline > 0)
+    {
+        // Pipelined time stepping, frames are printed in order as steps finish
+        Pipeline pipe;
+        initPipeline(&pipe, &grid, n_stop, options.pipeline, options.kernel, &sink);
+        runPipeline(&pipe);
+        freePipeline(&pipe);
+    }
+    else
+    {
+        status = runSerialJob(&grid, &options, &sink, report);
+    }
+
+    if (sink.stream != NULL)
+    {
+        closeFrameStream(sink.stream);
+    }
+    if (sink.renderer != NULL)
+    {
+        freeRenderer(sink.renderer);
+    }
+
+    // Live and peak memory per subsystem
+    fprintf(report, "\n");
+    printMemoryReport(report);
+
+    return status;
 }
+#endif
 
 // ************************************End of file******************************
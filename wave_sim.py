@@ -6,6 +6,17 @@ Description: Simulates and plots the 2D wave equation
 
 # ~~~~~~~~~~ Python Libraries ~~~~~~~~~~~~~
 
+import argparse
+import ctypes
+import gc
+import json
+import os
+import struct
+import subprocess
+import tempfile
+import time
+import tracemalloc
+
 import numpy as np
 import matplotlib.pyplot as plt
 from mpl_toolkits.mplot3d import Axes3D
@@ -20,8 +31,78 @@ w = 18.0e-15   # Width of the pulse
 T0 = 4.0e-15   # Initial time
 c = 299792458  # Speed of light
 
+PARITY_TOLERANCE = 1e-12  # Largest backend difference, relative to the peak field
+
 # ~~~~~~~~~~ Class Definitions ~~~~~~~~~~~~~
 
+class MethodProfiler:
+    # Records wall time and allocated bytes of every call to the wrapped
+    # methods, per time step. Traces use the Chrome trace event format, the
+    # same one the C solver writes with --trace.
+
+    def __init__(self, track_allocations=True):
+        self.track_allocations = track_allocations
+        self.events = []    # (name, step, start s, duration s, allocated bytes)
+        self.step = 0
+        self.origin = time.perf_counter()
+
+        if track_allocations and not tracemalloc.is_tracing():
+            tracemalloc.start()
+
+    def wrap(self, obj, names):
+
+        # Shadow each method on this instance with a timed wrapper
+        for name in names:
+            setattr(obj, name, self._timed(name, getattr(obj, name)))
+
+    def _timed(self, name, method):
+        def wrapper(*args, **kwargs):
+            before = 0
+            if self.track_allocations:
+                tracemalloc.reset_peak()
+                before = tracemalloc.get_traced_memory()[0]
+
+            start = time.perf_counter()
+            result = method(*args, **kwargs)
+            duration = time.perf_counter() - start
+
+            # Peak growth during the call counts temporaries that were freed
+            allocated = tracemalloc.get_traced_memory()[1] - before if self.track_allocations else 0
+            self.events.append((name, self.step, start - self.origin, duration, allocated))
+            return result
+
+        return wrapper
+
+    def record(self, name, start):
+        self.events.append((name, self.step, start - self.origin, time.perf_counter() - start, 0))
+
+    def summary(self):
+        totals = {}
+        for name, step, start, duration, allocated in self.events:
+            calls, seconds, allocs = totals.get(name, (0, 0.0, 0))
+            totals[name] = (calls + 1, seconds + duration, allocs + allocated)
+
+        step_seconds = totals.get('step', (0, 0.0, 0))[1]
+        lines = [f"{'method':<20} {'calls':>6} {'total s':>10} {'mean ms':>10} {'% step':>8} {'KiB/call':>10}"]
+        for name, (calls, seconds, allocs) in sorted(totals.items(), key=lambda item: -item[1][1]):
+            if name == 'step':
+                continue
+            share = 100 * seconds / step_seconds if step_seconds > 0 else 0.0
+            lines.append(f"{name:<20} {calls:>6} {seconds:>10.4f} {1e3 * seconds / calls:>10.3f}"
+                         f" {share:>7.1f}% {allocs / calls / 1024:>10.1f}")
+        return '\n'.join(lines)
+
+    def export_trace(self, path, Nx, Ny):
+        events = [{'name': name, 'cat': 'wave', 'ph': 'X', 'ts': start * 1e6, 'dur': duration * 1e6,
+                   'pid': 1, 'tid': 0, 'args': {'step': step, 'allocated': allocated}}
+                  for name, step, start, duration, allocated in self.events]
+        trace = {'otherData': {'backend': 'python', 'Nx': Nx, 'Ny': Ny},
+                 'displayTimeUnit': 'ms',
+                 'traceEvents': events}
+        with open(path, 'w') as f:
+            json.dump(trace, f, indent=1)
+
+
 class WaveSimulation2D:
     def __init__(self, Lx, Ly, dx, dy, n_stop, l, w, T0, c):
 
@@ -112,21 +193,413 @@ class WaveSimulation2D:
         ax.set_title(f"Time Step {n + 1}")
         plt.pause(0.001)
 
-    def run_simulation(self):
-        fig = plt.figure()
-        ax = fig.add_subplot(111, projection='3d')
-
+    def frames(self, every=1, profiler=None):
+        # Time marching driven by the consumer: a step is only computed when
+        # the next frame is asked for. Every every-th level is yielded as a
+        # read-only view of Un1, valid until the next frame is asked for, so
+        # frames the consumer skips or does not keep are never copied.
+        if every < 1:
+            raise ValueError(f"every must be at least 1, not {every}")
         for n in range(self.n_stop):
+            step_start = time.perf_counter()
+            if profiler is not None:
+                profiler.step = n
+
             self.update_interior()
             self.apply_source(n)
             self.update_boundaries()
+            if n % every == every - 1:
+                frame = self.Un1.view()
+                frame.flags.writeable = False
+                yield n, frame
+            self.step_time()
+
+            if profiler is not None:
+                profiler.record('step', step_start)
+
+    def run_simulation(self, profiler=None):
+        fig = plt.figure()
+        ax = fig.add_subplot(111, projection='3d')
+
+        if profiler is not None:
+            profiler.wrap(self, ['update_interior', 'apply_source', 'update_boundaries',
+                                 'store_fields', 'plot_solution', 'step_time'])
+
+        for n, frame in self.frames(profiler=profiler):
             self.store_fields(n)
             self.plot_solution(ax, n)
-            self.step_time()
 
         plt.show()
 
 
+class VectorizedWaveSimulation2D(WaveSimulation2D):
+    # Same scheme and evaluation order as WaveSimulation2D, with the node loops
+    # written as NumPy slices. The slices index the last two axes, so the same
+    # updates step a batch of fields with a leading ensemble axis.
+
+    def update_interior(self):
+        U0 = self.Un0
+        self.Un1[..., 1:-1, 1:-1] = (2 * U0[..., 1:-1, 1:-1]
+                                     + self.Ox**2 * (U0[..., 2:, 1:-1] - 2 * U0[..., 1:-1, 1:-1] + U0[..., :-2, 1:-1])
+                                     + self.Oy**2 * (U0[..., 1:-1, 2:] - 2 * U0[..., 1:-1, 1:-1] + U0[..., 1:-1, :-2])
+                                     - self.Un_1[..., 1:-1, 1:-1])
+
+    def update_boundaries(self):
+        coef_x = (self.c * self.dt - self.dx) / (self.c * self.dt + self.dx)
+        coef_y = (self.c * self.dt - self.dy) / (self.c * self.dt + self.dy)
+        U1 = self.Un1
+        U0 = self.Un0
+
+        # Left and right boundaries
+        U1[..., 0, 1:-1] = U0[..., 1, 1:-1] + coef_x * (U1[..., 1, 1:-1] - U0[..., 0, 1:-1])
+        U1[..., -1, 1:-1] = U0[..., -2, 1:-1] + coef_x * (U1[..., -2, 1:-1] - U0[..., -1, 1:-1])
+
+        # Top and bottom boundaries
+        U1[..., 1:-1, -1] = U0[..., 1:-1, -2] + coef_y * (U1[..., 1:-1, -2] - U0[..., 1:-1, -1])
+        U1[..., 1:-1, 0] = U0[..., 1:-1, 1] + coef_y * (U1[..., 1:-1, 1] - U0[..., 1:-1, 0])
+
+        # Corner nodes
+        U1[..., 0, 0] = 0.5 * (U1[..., 1, 0] + U1[..., 0, 1])
+        U1[..., -1, 0] = 0.5 * (U1[..., -2, 0] + U1[..., -1, 1])
+        U1[..., -1, -1] = 0.5 * (U1[..., -2, -1] + U1[..., -1, -2])
+        U1[..., 0, -1] = 0.5 * (U1[..., 1, -1] + U1[..., 0, -2])
+
+
+class EnsembleWaveSimulation2D(VectorizedWaveSimulation2D):
+    # A batch of simulations on one grid, stepped together so the interpreter
+    # overhead of each step is paid once for the whole batch. The fields carry
+    # a leading ensemble axis, Un1[k] is member k. The grid and c are shared,
+    # while l, w and T0 may be arrays with one value per member, and each
+    # member may put its source at its own node.
+
+    def __init__(self, Lx, Ly, dx, dy, n_stop, l, w, T0, c, source_nodes=None):
+        l, w, T0 = np.broadcast_arrays(np.atleast_1d(np.asarray(l, dtype=float)),
+                                       np.atleast_1d(np.asarray(w, dtype=float)),
+                                       np.atleast_1d(np.asarray(T0, dtype=float)))
+        super().__init__(Lx, Ly, dx, dy, n_stop, l, w, T0, c)
+        self.members = len(l)
+
+        # Source node of each member, (50, 50) like WaveSimulation2D by default
+        if source_nodes is None:
+            source_nodes = [(50, 50)] * self.members
+        source_nodes = np.asarray(source_nodes, dtype=int).reshape(self.members, 2)
+        self.source_rows = source_nodes[:, 0]
+        self.source_cols = source_nodes[:, 1]
+        self.member_index = np.arange(self.members)
+
+        # Initialize fields with the ensemble axis first
+        shape = (self.members, self.Nx, self.Ny)
+        self.Un1 = np.zeros(shape)   # Time level n+1
+        self.Un0 = np.zeros(shape)   # Time level n
+        self.Un_1 = np.zeros(shape)  # Time level n-1
+        self.U_value = np.zeros(shape + (n_stop,))
+
+        # Member drawn by plot_solution
+        self.plot_member = 0
+
+    def apply_source(self, n):
+
+        # Every member's source value in one expression, scattered in one assignment
+        values = (np.exp(-1 * ((n * self.dt - self.T0) / (self.w / 2))**2)
+                  * np.sin(((2 * np.pi * self.c) / self.l) * (n * self.dt)))
+        self.Un1[self.member_index, self.source_rows, self.source_cols] = values
+
+    def store_fields(self, n):
+        self.U_value[..., n] = self.Un1
+
+    def plot_solution(self, ax, n):
+        ax.clear()
+        ax.plot_surface(self.Y_grid, self.X_grid, self.U_value[self.plot_member, :, :, n], cmap='viridis')
+        ax.set_zlim(-0.6, 0.6)
+        ax.set_xlabel('Y')
+        ax.set_ylabel('X')
+        ax.set_zlabel('U')
+        ax.set_title(f"Member {self.plot_member}, Time Step {n + 1}")
+        plt.pause(0.001)
+
+
+# ~~~~~~~~~~ Backend Parity ~~~~~~~~~~~~~
+
+def run_python_backend(simulation_class, steps):
+    # Time march without plotting, returns the fields of every step and the
+    # seconds spent stepping
+    simulation = simulation_class(Lx, Ly, dx, dy, steps, l, w, T0, c)
+
+    start = time.perf_counter()
+    for n in range(steps):
+        simulation.update_interior()
+        simulation.apply_source(n)
+        simulation.update_boundaries()
+        simulation.store_fields(n)
+        simulation.step_time()
+    elapsed = time.perf_counter() - start
+
+    return np.moveaxis(simulation.U_value, 2, 0), elapsed
+
+
+def read_frame_stream(data):
+    # Frames of the C solver's --stream output: a 40-byte header (magic,
+    # header size, step, rows, cols, stride, time, payload size), then
+    # rows * cols native-endian doubles
+    frames = []
+    offset = 0
+    while offset < len(data):
+        magic, header_size, step, rows, cols, stride, t, payload = struct.unpack_from('=4s5IdQ', data, offset)
+        if magic != b'WVF1':
+            raise ValueError(f"bad frame magic at byte {offset}")
+        values = np.frombuffer(data, dtype=np.float64, count=rows * cols, offset=offset + header_size)
+        frames.append(values.reshape(rows, cols))
+        offset += header_size + payload
+    return np.array(frames)
+
+
+def run_c_backend(sim_path, Nx, Ny):
+    # Stepping time from a run with --trace (no display), fields from a run
+    # streaming every frame. The C solver always runs its own n_stop steps.
+    grid = f'--grid={Nx}x{Ny}'
+    with tempfile.TemporaryDirectory() as tmp:
+        trace_path = os.path.join(tmp, 'trace.json')
+        subprocess.run([sim_path, grid, '--no-display', f'--trace={trace_path}'],
+                       stdout=subprocess.DEVNULL, check=True)
+        with open(trace_path) as f:
+            events = json.load(f)['traceEvents']
+
+    elapsed = sum(event['dur'] for event in events if event['name'] == 'step') * 1e-6
+    stream = subprocess.run([sim_path, grid, '--stream=-'], stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL, check=True).stdout
+
+    return read_frame_stream(stream), elapsed
+
+
+def run_native_backend(library, Nx, Ny, steps):
+    # Frames pulled from the C solver loaded as a library. Each view is
+    # copied because the next frame reuses its buffer.
+    start = time.perf_counter()
+    fields = [frame.copy() for n, frame in native_frames(library, Nx, Ny, steps)]
+    elapsed = time.perf_counter() - start
+
+    return np.array(fields), elapsed
+
+
+def check_native_views(library, Nx, Ny, steps, last):
+    # Frames kept as views past the end of native_frames must stay readable:
+    # the generator is finished and collected, but the views still hold the
+    # solver's buffer. The last view still shows the last step.
+    kept = [frame for n, frame in native_frames(library, Nx, Ny, steps)]
+    gc.collect()
+    return np.array_equal(kept[-1], last)
+
+
+def run_ensemble_backend(steps, members=4):
+    # Member 0 of a batch whose other members use other wavelengths, so it
+    # checks that the members do not leak into each other
+    wavelengths = l * np.linspace(1.0, 1.5, members)
+    simulation = EnsembleWaveSimulation2D(Lx, Ly, dx, dy, steps, wavelengths, w, T0, c)
+
+    start = time.perf_counter()
+    for n in range(steps):
+        simulation.update_interior()
+        simulation.apply_source(n)
+        simulation.update_boundaries()
+        simulation.store_fields(n)
+        simulation.step_time()
+    elapsed = time.perf_counter() - start
+
+    return np.moveaxis(simulation.U_value[0], 2, 0), elapsed
+
+
+# Python backends by name, each returns (fields[step, x, y], seconds)
+PARITY_BACKENDS = {
+    'python': lambda steps: run_python_backend(WaveSimulation2D, steps),
+    'numpy': lambda steps: run_python_backend(VectorizedWaveSimulation2D, steps),
+    'ensemble': run_ensemble_backend,
+}
+
+
+def run_parity(steps, sim_path, library):
+    # Runs every backend on the same configuration and compares each one's
+    # fields with the reference loops of WaveSimulation2D over the steps both ran.
+    # Node (ii, jj) is C row ii, column jj: the X and Y coordinate arrays are
+    # only used for plotting, so Y starting at -Ly/2 does not shift anything.
+    # np.arange includes the end point where the C Nx and Ny defines round
+    # down, so the C solver is given the Python grid size.
+    results = {}
+    for name, backend in PARITY_BACKENDS.items():
+        results[name] = backend(steps)
+    Nx, Ny = results['python'][0].shape[1:]
+
+    if os.path.exists(sim_path):
+        results['c'] = run_c_backend(sim_path, Nx, Ny)
+    else:
+        print(f"skipping the C backend, {sim_path} not found (build it with gcc -O2 -o sim wave_sim.c -lm -pthread)")
+    if os.path.exists(library):
+        results['native'] = run_native_backend(library, Nx, Ny, steps)
+    else:
+        print(f"skipping the native backend, {library} not found (build it with {NATIVE_BUILD})")
+
+    reference = results['python'][0]
+    scale = np.max(np.abs(reference))
+    print(f"{'backend':<10} {'steps':>6} {'steps/s':>12} {'speedup':>9} {'max |diff|':>12} {'relative':>10}")
+    base_rate = len(reference) / results['python'][1]
+    status = 0
+    for name, (fields, elapsed) in results.items():
+        common = min(len(fields), len(reference))
+        if fields.shape[1:] != reference.shape[1:]:
+            print(f"{name:<10} grid {fields.shape[1:]} differs from {reference.shape[1:]}")
+            status = 1
+            continue
+
+        difference = np.max(np.abs(fields[:common] - reference[:common]))
+        rate = len(fields) / elapsed
+        print(f"{name:<10} {len(fields):>6} {rate:>12.1f} {rate / base_rate:>8.1f}x"
+              f" {difference:>12.3e} {difference / scale:>10.2e}")
+        if difference > PARITY_TOLERANCE * scale:
+            status = 1
+
+    if status:
+        print(f"backends disagree by more than {PARITY_TOLERANCE} of the peak field")
+    if 'native' in results and not check_native_views(library, Nx, Ny, steps,
+                                                      results['native'][0][-1]):
+        print("native frame views kept past the generator do not show the last step")
+        status = 1
+    return status
+
+
+# ~~~~~~~~~~ Native Frames ~~~~~~~~~~~~~
+
+NATIVE_BUILD = "gcc -O2 -shared -fPIC -DWAVE_SIM_LIBRARY -o libwave_sim.so wave_sim.c -lm -pthread"
+
+
+def load_native(library):
+    # The C solver built as a shared library, with the frame iterator's
+    # signatures declared for ctypes
+    lib = ctypes.CDLL(os.path.abspath(library))
+    lib.openFrames.restype = ctypes.c_void_p
+    lib.openFrames.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_char_p, ctypes.c_int]
+    lib.nextFrame.restype = ctypes.POINTER(ctypes.c_double)
+    lib.nextFrame.argtypes = [ctypes.c_void_p, ctypes.c_int]
+    lib.frameStride.restype = ctypes.c_int
+    lib.frameStride.argtypes = [ctypes.c_void_p]
+    lib.frameStep.restype = ctypes.c_int
+    lib.frameStep.argtypes = [ctypes.c_void_p]
+    lib.closeFrames.restype = None
+    lib.closeFrames.argtypes = [ctypes.c_void_p]
+    return lib
+
+
+class NativeFrameOwner:
+    # Holds an iterator from openFrames and is the base of every frame view
+    # into its buffers, so they are freed only once the generator and all
+    # the views are gone
+
+    def __init__(self, lib, handle):
+        self.lib = lib
+        self.handle = handle
+
+    def view(self, pointer, Nx, Ny, stride):
+        # Read-only (Nx, Ny) view of a time level whose rows are stride
+        # doubles apart, with this owner as its base
+        itemsize = ctypes.sizeof(ctypes.c_double)
+        self.__array_interface__ = {
+            'version': 3,
+            'typestr': np.dtype(np.float64).str,
+            'shape': (Nx, Ny),
+            'strides': (stride * itemsize, itemsize),
+            'data': (ctypes.addressof(pointer.contents), True),
+        }
+        return np.asarray(self)
+
+    def __del__(self):
+        self.lib.closeFrames(self.handle)
+
+
+def native_frames(library, Nx, Ny, steps, every=1, kernel='scalar'):
+    # Generator over the C solver's fields, like WaveSimulation2D.frames, with
+    # the same step index n. The solver advances only when the next frame is
+    # asked for, every steps at a time. Each frame is a read-only NumPy view
+    # of the solver's own buffer (rows are padded, so the view is strided).
+    # Its values are those of step n until the next frame is asked for, and
+    # the buffer stays allocated as long as the view exists.
+    if every < 1:
+        raise ValueError(f"every must be at least 1, not {every}")
+    lib = load_native(library)
+    handle = lib.openFrames(Nx, Ny, kernel.encode(), steps)
+    if not handle:
+        raise ValueError(f"unknown kernel {kernel} or a {Nx} x {Ny} grid without "
+                         "the source node (50, 50) inside")
+
+    owner = NativeFrameOwner(lib, handle)
+    stride = lib.frameStride(handle)
+    while True:
+        pointer = lib.nextFrame(handle, every - 1)
+        if not pointer:
+            return
+        yield lib.frameStep(handle), owner.view(pointer, Nx, Ny, stride)
+
+
+# ~~~~~~~~~~ Ensemble Sweeps ~~~~~~~~~~~~~
+
+def march(simulation, steps):
+    # Time march without storing or plotting
+    for n in range(steps):
+        simulation.update_interior()
+        simulation.apply_source(n)
+        simulation.update_boundaries()
+        simulation.step_time()
+
+
+def run_ensemble_sweep(members, steps):
+    # A wavelength sweep run as one batch and as one simulation per
+    # wavelength. Prints both times and the largest difference of the final
+    # fields, which is zero: each member does the same arithmetic.
+    wavelengths = l * np.linspace(0.5, 1.5, members)
+
+    start = time.perf_counter()
+    batch = EnsembleWaveSimulation2D(Lx, Ly, dx, dy, steps, wavelengths, w, T0, c)
+    march(batch, steps)
+    batch_seconds = time.perf_counter() - start
+
+    start = time.perf_counter()
+    difference = 0.0
+    for k, wavelength in enumerate(wavelengths):
+        single = VectorizedWaveSimulation2D(Lx, Ly, dx, dy, steps, wavelength, w, T0, c)
+        march(single, steps)
+        difference = max(difference, np.max(np.abs(single.Un0 - batch.Un0[k])))
+    single_seconds = time.perf_counter() - start
+
+    member_steps = members * steps
+    print(f"{'run':<10} {'members':>8} {'steps':>6} {'seconds':>9} {'member steps/s':>15}")
+    print(f"{'single':<10} {members:>8} {steps:>6} {single_seconds:>9.3f} {member_steps / single_seconds:>15.1f}")
+    print(f"{'ensemble':<10} {members:>8} {steps:>6} {batch_seconds:>9.3f} {member_steps / batch_seconds:>15.1f}")
+    print(f"speedup {single_seconds / batch_seconds:.1f}x, max |diff| {difference:.3e}")
+    return 0 if difference == 0.0 else 1
+
+
 if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="2D wave equation simulation")
+    parser.add_argument('--profile', action='store_true', help="print per-method timings")
+    parser.add_argument('--trace', metavar='PATH', help="write per-method timings as Chrome trace JSON")
+    parser.add_argument('--no-alloc', action='store_true', help="skip allocation tracking while profiling")
+    parser.add_argument('--parity', action='store_true', help="compare the backends' fields and speed")
+    parser.add_argument('--parity-steps', type=int, default=30, metavar='N', help="steps of the Python backends")
+    parser.add_argument('--sim', default='./sim', metavar='PATH', help="C solver binary for --parity")
+    parser.add_argument('--native', default='./libwave_sim.so', metavar='PATH', help="C solver library for --parity")
+    parser.add_argument('--ensemble', type=int, metavar='M', help="time an M-member wavelength sweep as one batch")
+    args = parser.parse_args()
+
+    if args.parity:
+        raise SystemExit(run_parity(args.parity_steps, args.sim, args.native))
+    if args.ensemble:
+        raise SystemExit(run_ensemble_sweep(args.ensemble, n_stop))
+
+    profiler = None
+    if args.profile or args.trace:
+        profiler = MethodProfiler(track_allocations=not args.no_alloc)
+
     simulation = WaveSimulation2D(Lx, Ly, dx, dy, n_stop, l, w, T0, c)
-    simulation.run_simulation()
+    simulation.run_simulation(profiler)
+
+    if profiler is not None:
+        print(profiler.summary())
+        if args.trace:
+            profiler.export_trace(args.trace, simulation.Nx, simulation.Ny)